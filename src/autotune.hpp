@@ -0,0 +1,191 @@
+﻿#pragma once
+#include <string>
+#include <map>
+#include <fstream>
+#include <chrono>
+
+enum class backend { interpreter, compiled, native };
+
+// How a graph should be evaluated: update()/backward() for the interpreter, updateC()/backwardC() otherwise
+struct backendChoice {
+	backend kind = backend::interpreter;
+	int chunkSize = 0;                    // statements per chunk function of the compiled kernels
+	std::string flags = "-O3 -ffast-math"; // compiler flags of the compiled kernels
+	bool usesKernels() const { return kind != backend::interpreter; }
+	std::string toString() const {
+		constexpr const char* names[] = {"interpreter", "compiled", "native"};
+		return kind == backend::compiled ? fmt::format("{} (chunk size {}, {})", names[(int)kind], chunkSize, flags) : names[(int)kind];
+	}
+};
+
+// Seconds for building the kernels and for one iteration (forward + backward) of each backend
+struct backendCosts {
+	double interpreterIter = 0;
+	double compiledBuild = 0, compiledIter = 0;
+	double nativeBuild = 0, nativeIter = 0;
+};
+
+// Picks the backend for a graph and a number of iterations: a one-off build cost pays off only
+// if enough iterations run. The costs come from a model over the node counts, or from a short
+// trial run of every backend, which is cached per graph signature in a file.
+class autotuner {
+	std::string cacheFile;
+	std::map<std::string, backendCosts> cache;
+
+	// Graphs with the same counts are assumed to perform the same
+	static std::string signature(nodeCountInfo const& c) {
+		std::string s = fmt::format("n{}t{}d{}", c.nNodes, c.nTreeNodes, c.depth);
+		for (auto& [name, n] : c.opCounts)
+			s += fmt::format("_{}{}", name, n);
+		return s;
+	}
+	void save() const {
+		if (cacheFile.empty())
+			return;
+		std::ofstream file(cacheFile);
+		for (auto& [key, c] : cache)
+			file << fmt::format("{} {} {} {} {} {}\n", key, c.interpreterIter, c.compiledBuild, c.compiledIter, c.nativeBuild, c.nativeIter);
+	}
+	static double seconds(std::chrono::steady_clock::time_point start) {
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+	// Interpreter and kernels leave gradients behind, trials must not change them
+	static std::vector<std::pair<accum*, accum>> saveGrads(dual const& loss) {
+		std::vector<std::pair<accum*, accum>> grads;
+		for (auto* e : expr::buildPlan({loss.getExpr()}))
+			grads.emplace_back(&e->grad, e->grad);
+		return grads;
+	}
+public:
+	// Cost model, calibrated on x86-64 with gcc. Seconds per node or per operation.
+	static constexpr double interpreterNode = 15e-9, interpreterTranscendental = 20e-9;
+	static constexpr double compiledOp = 1.5e-9, compiledTranscendental = 10e-9;
+	static constexpr double nativeOp = 2.5e-9, nativeTranscendental = 12e-9, nativeBuildOp = 1e-6;
+	static constexpr double compilerStart = 25e-3, compilerOpO3 = 30e-6, compilerOpO1 = 10e-6;
+	static constexpr int largeGraphOps = 50000; // beyond this -O1 builds much faster for little loss
+
+	autotuner(std::string cacheFile = "") : cacheFile{cacheFile} {
+		std::ifstream file(cacheFile);
+		std::string key;
+		backendCosts c;
+		while (file >> key >> c.interpreterIter >> c.compiledBuild >> c.compiledIter >> c.nativeBuild >> c.nativeIter)
+			cache[key] = c;
+	}
+
+	static backendChoice compileOptions(nodeCountInfo const& c) {
+		backendChoice choice;
+		choice.chunkSize = c.nNodes > dual::autoChunkThreshold ? dual::defaultChunkSize : 0;
+		if (c.nOps > largeGraphOps)
+			choice.flags = "-O1 -ffast-math";
+		return choice;
+	}
+	static backendCosts estimate(nodeCountInfo const& c) {
+		backendCosts costs;
+		// The recursive interpreter visits shared subgraphs once per use, the kernels once
+		double transcendentalShare = c.nOps ? (double)c.nTranscendental / c.nOps : 0;
+		costs.interpreterIter = c.nTreeNodes * (interpreterNode + transcendentalShare*interpreterTranscendental);
+		costs.compiledIter = c.nOps*compiledOp + c.nTranscendental*compiledTranscendental;
+		costs.nativeIter = c.nOps*nativeOp + c.nTranscendental*nativeTranscendental;
+		costs.compiledBuild = compilerStart + c.nOps*(c.nOps > largeGraphOps ? compilerOpO1 : compilerOpO3);
+		costs.nativeBuild = c.nOps*nativeBuildOp;
+		return costs;
+	}
+	static backend cheapest(backendCosts const& c, int nIters) {
+		double interpreter = nIters*c.interpreterIter;
+		double compiled = c.compiledBuild + nIters*c.compiledIter;
+		double native = nativeKernels ? c.nativeBuild + nIters*c.nativeIter : INFINITY;
+		if (interpreter <= compiled && interpreter <= native)
+			return backend::interpreter;
+		return compiled < native ? backend::compiled : backend::native;
+	}
+
+	static backendChoice choose(dual& loss, nodeCountInfo const& counts, backendCosts const& costs, int nIters, DynamicLoader& dl, NativeEmitter& em) {
+		auto choice = compileOptions(counts);
+		choice.kind = cheapest(costs, nIters);
+		apply(loss, choice, dl, em);
+		return choice;
+	}
+	// Decision from the cost model alone (or cached measurements), builds the chosen kernels
+	backendChoice select(dual& loss, int nIters, DynamicLoader& dl, NativeEmitter& em) {
+		AutoTimer at(g_timer, _FUNC_);
+		auto counts = loss.getNumNodes();
+		auto it = cache.find(signature(counts));
+		return choose(loss, counts, it != cache.end() ? it->second : estimate(counts), nIters, dl, em);
+	}
+	// Measures nTrials iterations of every backend on the graph itself, unless the measurements
+	// of an equal graph are cached, and builds the chosen kernels. The kernels of the winning
+	// trial stay installed.
+	backendChoice tune(dual& loss, int nIters, DynamicLoader& dl, NativeEmitter& em, int nTrials = 20) {
+		AutoTimer at(g_timer, _FUNC_);
+		auto counts = loss.getNumNodes();
+		auto key = signature(counts);
+		if (auto it = cache.find(key); it != cache.end())
+			return choose(loss, counts, it->second, nIters, dl, em);
+
+		auto choice = compileOptions(counts);
+		auto grads = saveGrads(loss);
+		auto trial = [&](bool kernels) {
+			auto start = std::chrono::steady_clock::now();
+			for (int i = 0; i < nTrials; ++i) {
+				if (kernels) {
+					loss.updateC();
+					loss.backwardC();
+				}
+				else {
+					loss.update();
+					loss.backward();
+				}
+			}
+			return seconds(start) / nTrials;
+		};
+		backendCosts c;
+		c.interpreterIter = trial(false);
+		auto start = std::chrono::steady_clock::now();
+		dual::kernels native = {};
+		if (nativeKernels) {
+			loss.compileNative(em);
+			native = loss.getKernels();
+			c.nativeBuild = seconds(start);
+			c.nativeIter = trial(true);
+		}
+		start = std::chrono::steady_clock::now();
+		compile(loss, choice, dl);
+		c.compiledBuild = seconds(start);
+		c.compiledIter = trial(true);
+		for (auto [p, g] : grads)
+			*p = g;
+
+		cache[key] = c;
+		save();
+		choice.kind = cheapest(c, nIters);
+		if (choice.kind == backend::native)
+			loss.setKernels(native);
+		if (choice.usesKernels())
+			loss.updateC();
+		else
+			loss.update();
+		return choice;
+	}
+	// Builds the compiled kernels with the flags of the choice, the loader keeps its own flags
+	static void compile(dual& loss, backendChoice const& choice, DynamicLoader& dl) {
+		auto flags = dl.flags;
+		dl.flags = choice.flags;
+		loss.compile(dl, choice.chunkSize);
+		dl.flags = flags;
+	}
+	static void apply(dual& loss, backendChoice const& choice, DynamicLoader& dl, NativeEmitter& em) {
+		switch (choice.kind) {
+		case backend::interpreter:
+			loss.update();
+			break;
+		case backend::compiled:
+			compile(loss, choice, dl);
+			loss.updateC();
+			break;
+		case backend::native:
+			loss.compileNative(em);
+			loss.updateC();
+			break;
+		}
+	}
+};
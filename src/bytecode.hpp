@@ -0,0 +1,309 @@
+﻿#pragma once
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <unordered_map>
+#include <unordered_set>
+
+// Operation, number of slot operands
+#define BYTECODE_FWD_OPS(X) \
+	X(fAdd, 3) X(fSub, 3) X(fMul, 3) X(fDiv, 3) X(fSqrt, 2) X(fExp, 2) X(fPow, 3) X(fPowc, 3) \
+	X(fSquare, 2) X(fSquaredDiff, 3) X(fMulAdd, 4) X(fCall, 2) X(fEnd, 0)
+#define BYTECODE_BWD_OPS(X) \
+	X(bAdd, 3) X(bSub, 3) X(bMul, 3) X(bDiv, 3) X(bSqrt, 2) X(bExp, 2) X(bPow, 3) X(bPowc, 3) \
+	X(bSquare, 2) X(bSquaredDiff, 3) X(bMulAdd, 4) X(bCall, 2) X(bEnd, 0)
+
+// Dispatch of the interpreter loops: computed goto where available, a switch otherwise
+#if defined __GNUC__
+	#define BYTECODE_LABEL(NAME, N) &&NAME##Label,
+	#define BYTECODE_BEGIN(OPS) static void* const labels[] = {OPS(BYTECODE_LABEL)}; goto *labels[*pc];
+	#define BYTECODE_CASE(NAME) NAME##Label:
+	#define BYTECODE_NEXT(N) pc += 1 + 4*(N); goto *labels[*pc]
+	#define BYTECODE_FINISH
+#else
+	#define BYTECODE_BEGIN(OPS) for (;;) switch (*pc) {
+	#define BYTECODE_CASE(NAME) case NAME:
+	#define BYTECODE_NEXT(N) pc += 1 + 4*(N); continue
+	#define BYTECODE_FINISH }
+#endif
+
+// The graph translated into a flat program for a register machine, evaluated without compiling
+// anything. Every node owns a slot in a register file of values and one of adjoints, instructions
+// are a one byte opcode followed by 32 bit slot numbers. The backward program is the reversed
+// forward program. Superinstructions replace (a-b)^2 and a + b*c when the inner node has no
+// other use, ops without an opcode of their own are called through their lane functions.
+//
+//   bytecode program(loss);
+//   program.update();   // sets loss.value()
+//   program.backward(); // adds to the gradients of the leaves like loss.backward()
+class bytecode {
+#define BYTECODE_ENUM(NAME, N) NAME,
+	enum fwdOp : uint8_t { BYTECODE_FWD_OPS(BYTECODE_ENUM) };
+	enum bwdOp : uint8_t { BYTECODE_BWD_OPS(BYTECODE_ENUM) };
+#undef BYTECODE_ENUM
+	struct call {
+		operation* op;
+		std::vector<uint32_t> parents;
+		std::vector<value_t const*> in; // the values of the parents in the register file
+		std::vector<accum*> adj;        // and their adjoints
+	};
+	expr* root;
+	uint32_t rootSlot;
+	std::vector<uint8_t> fwdCode, bwdCode;
+	std::vector<value_t> values;
+	std::vector<accum> adjoints;
+	std::vector<call> calls;
+	std::vector<std::pair<uint32_t, expr*>> loads, gradLeaves; // leaves read before update(), written after backward()
+	int nFused = 0;
+
+	static void emit(std::vector<uint8_t>& code, uint8_t op, std::initializer_list<uint32_t> slots) {
+		code.push_back(op);
+		for (uint32_t s : slots) {
+			size_t n = code.size();
+			code.resize(n + 4);
+			std::memcpy(&code[n], &s, 4);
+		}
+	}
+	template<class Op> static Op* as(expr const* e) {
+		return e->op ? dynamic_cast<Op*>(e->op) : nullptr;
+	}
+public:
+	bytecode(dual const& d) : root{d.getExpr()} {
+		AutoTimer at(g_timer, _FUNC_);
+		auto plan = expr::buildPlan({root});
+		std::unordered_map<expr const*, uint32_t> slots;
+		std::unordered_map<expr const*, int> uses;
+		for (uint32_t i = 0; i < plan.size(); ++i) {
+			slots[plan[i]] = i;
+			if (plan[i]->op)
+				for (auto& p : plan[i]->op->parents)
+					++uses[p.get()];
+		}
+		rootSlot = slots.at(root);
+		values.resize(plan.size());
+		auto slot = [&](exprp_t const& p) { return slots.at(p.get()); };
+		auto constantSlot = [&](calc c) {
+			values.push_back(c);
+			return (uint32_t)values.size()-1;
+		};
+		// Superinstructions: consumer -> position of the inner node among its parents. The inner node
+		// has no other use and gets no instructions of its own.
+		std::unordered_map<expr const*, int> fused;
+		std::unordered_set<expr const*> inner;
+		auto fusable = [&](exprp_t const& p) { return p.get() != root && uses[p.get()] == 1; };
+		for (auto* e : plan) {
+			int m = -1;
+			if (auto* op = as<powcGrad>(e); op && op->exponent == 2 && as<subGrad>(op->parents[0].get()) && fusable(op->parents[0]))
+				m = 0;
+			else if (auto* op = as<addGrad>(e))
+				m = as<mulGrad>(op->parents[1].get()) && fusable(op->parents[1]) ? 1 : as<mulGrad>(op->parents[0].get()) && fusable(op->parents[0]) ? 0 : -1;
+			if (m >= 0) {
+				fused[e] = m;
+				inner.insert(e->op->parents[m].get());
+			}
+		}
+
+		// The backward program is collected per node and put together in reverse
+		std::vector<std::vector<uint8_t>> bwdParts;
+		for (uint32_t i = 0; i < plan.size(); ++i) {
+			expr* e = plan[i];
+			if (inner.contains(e))
+				continue;
+			if (!e->op) {
+				values[i] = e->value;
+				if (!(e->flags & expr::constant))
+					loads.emplace_back(i, e);
+				if (e->needsGrad())
+					gradLeaves.emplace_back(i, e);
+				continue;
+			}
+			auto& ps = e->op->parents;
+			std::vector<uint8_t> bwd;
+			if (auto* op = as<powcGrad>(e); op && fused.contains(e)) {
+				auto& sub = ps[0]->op->parents;
+				emit(fwdCode, fSquaredDiff, {i, slot(sub[0]), slot(sub[1])});
+				emit(bwd, bSquaredDiff, {i, slot(sub[0]), slot(sub[1])});
+				++nFused;
+			}
+			else if (op) {
+				uint32_t c = op->exponent == 2 ? 0 : constantSlot(op->exponent);
+				if (op->exponent == 2) {
+					emit(fwdCode, fSquare, {i, slot(ps[0])});
+					emit(bwd, bSquare, {i, slot(ps[0])});
+				}
+				else {
+					emit(fwdCode, fPowc, {i, slot(ps[0]), c});
+					emit(bwd, bPowc, {i, slot(ps[0]), c});
+				}
+			}
+			else if (dynamic_cast<addGrad*>(e->op)) {
+				if (fused.contains(e)) {
+					int m = fused[e];
+					auto& mul = ps[m]->op->parents;
+					emit(fwdCode, fMulAdd, {i, slot(ps[1-m]), slot(mul[0]), slot(mul[1])});
+					emit(bwd, bMulAdd, {i, slot(ps[1-m]), slot(mul[0]), slot(mul[1])});
+					++nFused;
+				}
+				else {
+					emit(fwdCode, fAdd, {i, slot(ps[0]), slot(ps[1])});
+					emit(bwd, bAdd, {i, slot(ps[0]), slot(ps[1])});
+				}
+			}
+			else if (dynamic_cast<subGrad*>(e->op) || dynamic_cast<mulGrad*>(e->op) || dynamic_cast<divGrad*>(e->op) || dynamic_cast<powGrad*>(e->op)) {
+				auto [f, b] = dynamic_cast<subGrad*>(e->op) ? std::pair{fSub, bSub} : dynamic_cast<mulGrad*>(e->op) ? std::pair{fMul, bMul}
+							: dynamic_cast<divGrad*>(e->op) ? std::pair{fDiv, bDiv} : std::pair{fPow, bPow};
+				emit(fwdCode, f, {i, slot(ps[0]), slot(ps[1])});
+				emit(bwd, b, {i, slot(ps[0]), slot(ps[1])});
+			}
+			else if (dynamic_cast<sqrtGrad*>(e->op) || dynamic_cast<expGrad*>(e->op)) {
+				bool isSqrt = dynamic_cast<sqrtGrad*>(e->op);
+				emit(fwdCode, isSqrt ? fSqrt : fExp, {i, slot(ps[0])});
+				emit(bwd, isSqrt ? bSqrt : bExp, {i, slot(ps[0])});
+			}
+			else {
+				call c{e->op, {}, {}, {}};
+				for (auto& p : ps)
+					c.parents.push_back(slot(p));
+				calls.push_back(std::move(c));
+				emit(fwdCode, fCall, {i, (uint32_t)calls.size()-1});
+				emit(bwd, bCall, {i, (uint32_t)calls.size()-1});
+			}
+			if (e->needsGrad())
+				bwdParts.push_back(std::move(bwd));
+		}
+		emit(fwdCode, fEnd, {});
+		for (auto it = bwdParts.rbegin(); it != bwdParts.rend(); ++it)
+			bwdCode.insert(bwdCode.end(), it->begin(), it->end());
+		emit(bwdCode, bEnd, {});
+
+		// The register file is complete, the pointers into it stay valid
+		adjoints.resize(values.size());
+		for (auto& c : calls)
+			for (uint32_t p : c.parents) {
+				c.in.push_back(&values[p]);
+				c.adj.push_back(&adjoints[p]);
+			}
+	}
+	bytecode(bytecode const&) = delete;
+	bytecode& operator=(bytecode const&) = delete;
+
+	size_t codeSize() const { return fwdCode.size() + bwdCode.size(); }
+	int numFused() const { return nFused; }
+
+	calc update() {
+		AutoTimer at(g_timer, _FUNC_);
+		for (auto [i, e] : loads)
+			values[i] = e->value;
+		value_t* r = values.data();
+		uint8_t const* pc = fwdCode.data();
+		auto s = [&](int k) { uint32_t x; std::memcpy(&x, pc + 1 + 4*k, 4); return x; };
+		auto x = [&](int k) { return calc(r[s(k)]); };
+		BYTECODE_BEGIN(BYTECODE_FWD_OPS)
+		BYTECODE_CASE(fAdd) r[s(0)] = x(1) + x(2); BYTECODE_NEXT(3);
+		BYTECODE_CASE(fSub) r[s(0)] = x(1) - x(2); BYTECODE_NEXT(3);
+		BYTECODE_CASE(fMul) r[s(0)] = x(1) * x(2); BYTECODE_NEXT(3);
+		BYTECODE_CASE(fDiv) r[s(0)] = x(1) / x(2); BYTECODE_NEXT(3);
+		BYTECODE_CASE(fSqrt) r[s(0)] = calcSqrt(x(1)); BYTECODE_NEXT(2);
+		BYTECODE_CASE(fExp) r[s(0)] = calcExp(x(1)); BYTECODE_NEXT(2);
+		BYTECODE_CASE(fPow) r[s(0)] = calcPow(x(1), x(2)); BYTECODE_NEXT(3);
+		BYTECODE_CASE(fPowc) r[s(0)] = calcPow(x(1), x(2)); BYTECODE_NEXT(3);
+		BYTECODE_CASE(fSquare) r[s(0)] = x(1) * x(1); BYTECODE_NEXT(2);
+		BYTECODE_CASE(fSquaredDiff) {
+			calc d = x(1) - x(2);
+			r[s(0)] = d * d;
+			BYTECODE_NEXT(3);
+		}
+		BYTECODE_CASE(fMulAdd) r[s(0)] = x(1) + x(2) * x(3); BYTECODE_NEXT(4);
+		BYTECODE_CASE(fCall) {
+			auto& c = calls[s(1)];
+			c.op->fwdLanes(&r[s(0)], c.in.data(), 1);
+			BYTECODE_NEXT(2);
+		}
+		BYTECODE_CASE(fEnd) {
+			root->value = r[rootSlot];
+			return root->value;
+		}
+		BYTECODE_FINISH
+	}
+	// Needs the values of the last update()
+	void backward(accum gradient = 1) {
+		AutoTimer at(g_timer, _FUNC_);
+		std::fill(adjoints.begin(), adjoints.end(), 0);
+		adjoints[rootSlot] = gradient;
+		value_t const* r = values.data();
+		accum* a = adjoints.data();
+		uint8_t const* pc = bwdCode.data();
+		auto s = [&](int k) { uint32_t x; std::memcpy(&x, pc + 1 + 4*k, 4); return x; };
+		auto x = [&](int k) { return calc(r[s(k)]); };
+		BYTECODE_BEGIN(BYTECODE_BWD_OPS)
+		BYTECODE_CASE(bAdd) {
+			accum g = a[s(0)];
+			a[s(1)] += g;
+			a[s(2)] += g;
+			BYTECODE_NEXT(3);
+		}
+		BYTECODE_CASE(bSub) {
+			accum g = a[s(0)];
+			a[s(1)] += g;
+			a[s(2)] -= g;
+			BYTECODE_NEXT(3);
+		}
+		BYTECODE_CASE(bMul) {
+			accum g = a[s(0)];
+			a[s(1)] += g * x(2);
+			a[s(2)] += g * x(1);
+			BYTECODE_NEXT(3);
+		}
+		BYTECODE_CASE(bDiv) {
+			accum g = a[s(0)];
+			calc d = x(2);
+			a[s(1)] += g / d;
+			a[s(2)] -= g * x(1) / (d*d);
+			BYTECODE_NEXT(3);
+		}
+		BYTECODE_CASE(bSqrt) a[s(1)] += 0.5f * a[s(0)] / x(0); BYTECODE_NEXT(2);
+		BYTECODE_CASE(bExp) a[s(1)] += a[s(0)] * x(0); BYTECODE_NEXT(2);
+		BYTECODE_CASE(bPow) {
+			accum g = a[s(0)];
+			a[s(1)] += g * x(2) * calcPow(x(1), x(2)-1);
+			a[s(2)] += g * x(0) * calcLog(x(1));
+			BYTECODE_NEXT(3);
+		}
+		BYTECODE_CASE(bPowc) a[s(1)] += a[s(0)] * x(2) * calcPow(x(1), x(2)-1); BYTECODE_NEXT(3);
+		BYTECODE_CASE(bSquare) a[s(1)] += 2 * a[s(0)] * x(1); BYTECODE_NEXT(2);
+		BYTECODE_CASE(bSquaredDiff) {
+			accum t = 2 * a[s(0)] * (x(1) - x(2));
+			a[s(1)] += t;
+			a[s(2)] -= t;
+			BYTECODE_NEXT(3);
+		}
+		BYTECODE_CASE(bMulAdd) {
+			accum g = a[s(0)];
+			a[s(1)] += g;
+			a[s(2)] += g * x(3);
+			a[s(3)] += g * x(2);
+			BYTECODE_NEXT(4);
+		}
+		BYTECODE_CASE(bCall) {
+			auto& c = calls[s(1)];
+			c.op->bwdLanes(c.adj.data(), &a[s(0)], c.in.data(), &r[s(0)], 1);
+			BYTECODE_NEXT(2);
+		}
+		BYTECODE_CASE(bEnd) {
+			for (auto [i, e] : gradLeaves)
+				e->grad += a[i];
+			return;
+		}
+		BYTECODE_FINISH
+	}
+};
+
+#undef BYTECODE_LABEL
+#undef BYTECODE_BEGIN
+#undef BYTECODE_CASE
+#undef BYTECODE_NEXT
+#undef BYTECODE_FINISH
+#undef BYTECODE_FWD_OPS
+#undef BYTECODE_BWD_OPS
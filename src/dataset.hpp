@@ -0,0 +1,341 @@
+﻿#pragma once
+#include <vector>
+#include <deque>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#if defined _WIN32
+	void const* mapFile(std::string const& fileName, size_t& size){
+		HANDLE file = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+			return nullptr;
+		LARGE_INTEGER s;
+		GetFileSizeEx(file, &s);
+		size = (size_t)s.QuadPart;
+		HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		CloseHandle(file);
+		if (!mapping)
+			return nullptr;
+		void const* p = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		CloseHandle(mapping);
+		return p;
+	}
+	void unmapFile(void const* p, size_t){
+		UnmapViewOfFile(p);
+	}
+#else
+	#include <fcntl.h>
+	#include <sys/stat.h>
+	void const* mapFile(std::string const& fileName, size_t& size){
+		int fd = open(fileName.c_str(), O_RDONLY);
+		if (fd < 0)
+			return nullptr;
+		struct stat st;
+		fstat(fd, &st);
+		size = st.st_size;
+		void* p = size ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+		close(fd);
+		if (p == MAP_FAILED)
+			return nullptr;
+		madvise(p, size, MADV_SEQUENTIAL);
+		return p;
+	}
+	void unmapFile(void const* p, size_t size){
+		munmap((void*)p, size);
+	}
+#endif
+
+// Consecutive rows of a dataset, stored column by column
+struct dataChunk {
+	int rows = 0;
+	std::vector<std::vector<calc>> columns;
+};
+
+// Delivers the rows of a dataset in order. read() runs on the prefetch thread.
+class dataSource {
+public:
+	virtual ~dataSource() = default;
+	virtual int numColumns() const = 0;
+	// Fills chunk with up to maxRows rows, 0 rows at the end of the data
+	virtual void read(dataChunk& chunk, int maxRows) = 0;
+	virtual void rewind() = 0;
+};
+
+// Binary file mapped into memory: "AGDS", uint32 columns, uint64 rows, then every column as rows floats
+class columnarFile : public dataSource {
+	void const* data = nullptr;
+	size_t fileSize = 0;
+	float const* values = nullptr;
+	uint32_t nColumns = 0;
+	uint64_t nRows = 0, pos = 0;
+	static constexpr size_t headerSize = 16;
+public:
+	columnarFile(std::string const& fileName) {
+		data = mapFile(fileName, fileSize);
+		if (!data) {
+			std::cout << "ERROR: mapping " << fileName << "\n";
+			return;
+		}
+		char const* p = (char const*)data;
+		if (fileSize >= headerSize && !std::memcmp(p, "AGDS", 4)) {
+			std::memcpy(&nColumns, p + 4, 4);
+			std::memcpy(&nRows, p + 8, 8);
+		}
+		if (fileSize < headerSize || std::memcmp(p, "AGDS", 4) || fileSize < headerSize + nColumns*nRows*sizeof(float)) {
+			std::cout << "ERROR: " << fileName << " is no columnar data file\n";
+			nColumns = 0;
+			nRows = 0;
+			return;
+		}
+		values = (float const*)(p + headerSize);
+	}
+	~columnarFile() {
+		if (data)
+			unmapFile(data, fileSize);
+	}
+	columnarFile(columnarFile const&) = delete;
+	columnarFile& operator=(columnarFile const&) = delete;
+
+	static bool write(std::string const& fileName, std::vector<std::vector<float>> const& columns) {
+		uint32_t nc = columns.size();
+		uint64_t nr = columns.empty() ? 0 : columns[0].size();
+		std::ofstream file(fileName, std::ios::binary);
+		file.write("AGDS", 4);
+		file.write((char const*)&nc, 4);
+		file.write((char const*)&nr, 8);
+		for (auto& c : columns)
+			file.write((char const*)c.data(), nr*sizeof(float));
+		return file.good();
+	}
+	uint64_t size() const { return nRows; }
+	int numColumns() const override { return nColumns; }
+	// The copy out of the mapping is where the pages are read, on the prefetch thread
+	void read(dataChunk& chunk, int maxRows) override {
+		chunk.rows = (int)std::min<uint64_t>(maxRows, nRows - pos);
+		chunk.columns.resize(nColumns);
+		for (int c = 0; c < nColumns; ++c) {
+			chunk.columns[c].resize(chunk.rows);
+			float const* col = values + c*nRows + pos;
+			for (int r = 0; r < chunk.rows; ++r)
+				chunk.columns[c][r] = col[r];
+		}
+		pos += chunk.rows;
+	}
+	void rewind() override { pos = 0; }
+};
+
+// Whitespace separated numbers, one row per line like points.txt. The number of columns
+// is taken from the first line, lines with a different count are skipped.
+class textFile : public dataSource {
+	std::string fileName;
+	std::ifstream file;
+	int nColumns = 0;
+	std::vector<calc> row;
+
+	bool parseLine(std::string const& line) {
+		std::istringstream ss(line);
+		row.clear();
+		for (calc x; ss >> x;)
+			row.push_back(x);
+		return !row.empty() && (nColumns == 0 || row.size() == nColumns);
+	}
+public:
+	textFile(std::string const& fileName) : fileName{fileName} {
+		rewind();
+		std::string line;
+		while (nColumns == 0 && std::getline(file, line))
+			if (parseLine(line))
+				nColumns = row.size();
+		if (nColumns == 0)
+			std::cout << "ERROR: no data in " << fileName << "\n";
+		rewind();
+	}
+	int numColumns() const override { return nColumns; }
+	void read(dataChunk& chunk, int maxRows) override {
+		chunk.rows = 0;
+		chunk.columns.resize(nColumns);
+		for (auto& c : chunk.columns)
+			c.resize(maxRows);
+		std::string line;
+		while (chunk.rows < maxRows && std::getline(file, line)) {
+			if (!parseLine(line))
+				continue;
+			for (int c = 0; c < nColumns; ++c)
+				chunk.columns[c][chunk.rows] = row[c];
+			++chunk.rows;
+		}
+		for (auto& c : chunk.columns)
+			c.resize(chunk.rows);
+	}
+	void rewind() override {
+		file.close();
+		file.open(fileName);
+	}
+};
+
+// Reads the chunks of a source on a background thread, up to 'depth' chunks ahead of the consumer
+class prefetcher {
+	dataSource& source;
+	int chunkRows, depth;
+	std::deque<dataChunk> ready;
+	std::vector<dataChunk> spare; // consumed chunks, their buffers are reused
+	bool done = false, stop = false;
+	std::mutex m;
+	std::condition_variable cv;
+	std::thread worker;
+
+	void run() {
+		while (true) {
+			dataChunk chunk;
+			{
+				std::unique_lock lock(m);
+				cv.wait(lock, [&]() { return stop || ready.size() < depth; });
+				if (stop)
+					return;
+				if (!spare.empty()) {
+					chunk = std::move(spare.back());
+					spare.pop_back();
+				}
+			}
+			source.read(chunk, chunkRows);
+			std::lock_guard lock(m);
+			if (chunk.rows == 0) {
+				done = true;
+				cv.notify_all();
+				return;
+			}
+			ready.push_back(std::move(chunk));
+			cv.notify_all();
+		}
+	}
+public:
+	prefetcher(dataSource& source, int chunkRows, int depth = 2) : source{source}, chunkRows{chunkRows}, depth{depth} {
+		source.rewind();
+		worker = std::thread(&prefetcher::run, this);
+	}
+	~prefetcher() {
+		{
+			std::lock_guard lock(m);
+			stop = true;
+		}
+		cv.notify_all();
+		worker.join();
+	}
+	// Waits for the next chunk, false at the end of the data. The previous content of chunk is recycled.
+	bool next(dataChunk& chunk) {
+		std::unique_lock lock(m);
+		cv.wait(lock, [&]() { return done || !ready.empty(); });
+		if (!chunk.columns.empty())
+			spare.push_back(std::move(chunk));
+		if (ready.empty())
+			return false;
+		chunk = std::move(ready.front());
+		ready.pop_front();
+		cv.notify_all();
+		return true;
+	}
+};
+
+// The loss of a whole dataset, streamed through a graph of fixed size: the per-sample loss is
+// built once for chunkRows rows of placeholders, every chunk of the data is fed into them and
+// the loss and the gradients are accumulated over the chunks. Rows missing in the last chunk
+// repeat its last row with weight 0.
+//
+//   streamingLoss sl(2, 256, [&](std::vector<dual> const& row) { return pow(b + m*row[0] - row[1], 2); });
+//   columnarFile data("points.bin");
+//   opt.zeroGrad();
+//   calc loss = sl.evaluate(data); // mean loss, the mean gradient is added to b.grad() and m.grad()
+class streamingLoss {
+	int chunkRows;
+	std::vector<std::vector<dual>> inputs; // [column][row]
+	std::vector<dual> weights;
+	outputGroup total;
+	std::vector<expr*> params; // leaves receiving gradients
+	bool compiled = false;
+
+	static outputGroup build(int nColumns, int chunkRows, std::function<dual(std::vector<dual> const&)> const& sampleLoss,
+							 std::vector<std::vector<dual>>& inputs, std::vector<dual>& weights) {
+		inputs.resize(nColumns);
+		for (int c = 0; c < nColumns; ++c)
+			for (int r = 0; r < chunkRows; ++r)
+				inputs[c].push_back(dual::placeholder(fmt::format("d{}_{}", c, r)));
+		dual sum;
+		std::vector<dual> row(nColumns);
+		for (int r = 0; r < chunkRows; ++r) {
+			weights.push_back(dual::placeholder(fmt::format("w{}", r)));
+			for (int c = 0; c < nColumns; ++c)
+				row[c] = inputs[c][r];
+			sum = sum + weights[r]*sampleLoss(row);
+		}
+		return outputGroup({sum});
+	}
+public:
+	streamingLoss(int nColumns, int chunkRows, std::function<dual(std::vector<dual> const&)> const& sampleLoss)
+		: chunkRows{chunkRows}, total{build(nColumns, chunkRows, sampleLoss, inputs, weights)} {
+		for (auto* e : expr::buildPlan({total[0].getExpr()}))
+			if (!e->op && e->needsGrad())
+				params.push_back(e);
+	}
+	int numColumns() const { return inputs.size(); }
+	// The summed loss of one chunk
+	dual& chunkLoss() { return total[0]; }
+	// Evaluates the chunks with generated kernels, chunkSize as in dual::compile. The graph grows with
+	// chunkRows, the automatic chunking keeps its build time linear.
+	void compile(DynamicLoader& dl, int chunkSize = -1) {
+		total.compile(dl, chunkSize);
+		compiled = true;
+	}
+
+	// One pass over the data, returns the mean loss and adds the mean gradient to the leaves.
+	// prefetchDepth chunks are read ahead while the graph is evaluated.
+	calc evaluate(dataSource& source, int prefetchDepth = 2) {
+		AutoTimer at(g_timer, _FUNC_);
+		if (source.numColumns() != numColumns()) {
+			std::cout << fmt::format("ERROR: the data has {} columns, the loss takes {}\n", source.numColumns(), numColumns());
+			return 0;
+		}
+		std::vector<accum> before;
+		for (auto* p : params) {
+			before.push_back(p->grad);
+			p->grad = 0;
+		}
+		double loss = 0; // summed in double, datasets may have millions of rows
+		uint64_t rows = 0;
+		std::vector<calc> w(chunkRows);
+		const std::vector<accum> seeds = {1};
+		prefetcher pf(source, chunkRows, prefetchDepth);
+		dataChunk chunk;
+		while (pf.next(chunk)) {
+			for (int c = 0; c < numColumns(); ++c) {
+				auto& col = chunk.columns[c];
+				calc last = col[chunk.rows-1];
+				col.resize(chunkRows, last);
+				feed(inputs[c], col);
+			}
+			std::fill(w.begin(), w.end(), 0);
+			std::fill_n(w.begin(), chunk.rows, 1);
+			feed(weights, w);
+			if (compiled) {
+				total.updateC();
+				total.backwardC(seeds);
+			}
+			else {
+				total.update();
+				total.backward(seeds);
+			}
+			loss += total.value(0);
+			rows += chunk.rows;
+		}
+		for (int i = 0; i < params.size(); ++i)
+			params[i]->grad = before[i] + (rows ? params[i]->grad / rows : 0);
+		return rows ? loss / rows : 0;
+	}
+};
@@ -2,13 +2,17 @@
 #include <vector>
 #include <iterator>
 #include <set>
+#include <map>
+#include <deque>
+#include <string_view>
+#include <unordered_set>
 
-std::string tostr(float f) {
+std::string tostr(calc f) {
 	std::ostringstream oss;
 	oss << std::setprecision(3) << std::noshowpoint << f;
 	return oss.str();
 }
-std::string toHexFloatStr(float f) {
+std::string toHexFloatStr(calc f) {
 	std::ostringstream oss;
 	oss << std::hexfloat << f;
 	return oss.str();
@@ -26,37 +30,66 @@ template<enumeration T> inline T& operator|= (T& a, T b) { return (T&)((int&)a |
 template<enumeration T> inline T& operator&= (T& a, T b) { return (T&)((int&)a &= (int)b); }
 template<enumeration T> inline T& operator^= (T& a, T b) { return (T&)((int&)a ^= (int)b); }
 
+// Distinct nodes of a graph, shared subgraphs are counted once
 struct nodeCountInfo {
-	int nNodes = 0, nConstants = 0, nReqGrad = 0;
+	int nNodes = 0, nConstants = 0, nReqGrad = 0, nPlaceholders = 0;
+	int nOps = 0, nTranscendental = 0;
+	int depth = 0; // operations on the longest path from a leaf to the root
+	double nTreeNodes = 0; // nodes visited by the recursive update()/backward(), shared subgraphs once per use
+	std::map<std::string_view, int> opCounts;
 };
 
 
+// Interned node names, nodes only store the id. The table grows with the number of distinct
+// names, not with the number of nodes, and nothing has to be erased when nodes die.
+class nameTable {
+	std::vector<std::string> names = {""}; // id 0 = unnamed
+	std::unordered_map<std::string, uint32_t> ids;
+public:
+	uint32_t intern(std::string const& name) {
+		if (name.empty())
+			return 0;
+		auto [it, inserted] = ids.try_emplace(name, (uint32_t)names.size());
+		if (inserted)
+			names.push_back(name);
+		return it->second;
+	}
+	std::string const& get(uint32_t id) const { return names[id]; }
+};
+
 struct operation;
 
 struct expr {
-	static inline std::map<const expr*, std::string> namedict;
-	float value;
-	float grad;
+	static inline nameTable names;
+	value_t value;
+	accum grad;
+	accum adjoint = 0; // gradient accumulated during a plan-based (chunked) backward pass
 	operation* op;
+	uint32_t nameId = 0;
 	enum EFlags {
 		boring = 0,
 		requiresGrad = 1,
-		constant = 2
+		constant = 2,
+		placeholder = 4 // leaf whose value is fed before every evaluation
 	}flags = boring;
-	expr(float v, float g, operation* o, bool rg, bool c) :value{v}, grad{g}, op{o}, flags{(EFlags)(rg*requiresGrad | c*constant)}{}
+	expr(calc v, accum g, operation* o, bool rg, bool c) :value{v}, grad{g}, op{o}, flags{(EFlags)(rg*requiresGrad | c*constant)}{}
 	void update(); 
-	void backward(float gradient = 1.f);
-	void generateUpdate(std::stringstream& ss, std::set<expr const*>& visited);
-	void generateBackward(std::stringstream& ss, std::set<expr const*>& visited);
+	void backward(accum gradient = 1);
+	void generateFwdStatement(std::stringstream& ss);
+	void generateBwdStatements(std::stringstream& ss, std::set<expr const*>& seeded);
+	void emitFwdStatement(NativeEmitter& em);
+	void emitBwdStatements(NativeEmitter& em, std::set<expr const*>& seeded);
+	static std::vector<expr*> buildPlan(std::vector<expr*> const& roots);
+	static std::pair<std::string, std::string> generateKernelBodies(DynamicLoader& dl,
+		std::vector<expr*> const& roots, std::vector<expr*> const& plan, int chunkSize);
 	void countElems(nodeCountInfo& counter) const;
 	std::string printExpr() const;
+	template<class OutputIt> OutputIt printExpr(OutputIt out) const;
 	int getPrio() const;
+	bool needsGrad() const { return flags & requiresGrad; }
 	
-	std::string getVarName() const {
-		if (expr::namedict.contains(this))
-			return expr::namedict.at(this);
-		else
-			return "";
+	std::string const& getVarName() const {
+		return names.get(nameId);
 	}
 };
 
@@ -64,12 +97,24 @@ using exprp_t = std::shared_ptr<expr>;
 
 struct operation {
 	std::vector<exprp_t> parents;
-	virtual float fwd() = 0;
-	virtual float bwd(int i) = 0; // computes derivative wrt the i-th parent
+	expr const* result = nullptr; // the node of the operation, holds its current value whichever backend computed it
+	virtual calc fwd() = 0;
+	virtual calc bwd(int i) = 0; // computes derivative wrt the i-th parent
+	// Lane versions for ensembles: in[j] points to the K lanes of the j-th parent, out to those of the result.
+	// bwdLanes adds the contributions of the result's adjoint g to the adjoints adj[j] of all parents, null ones are skipped
+	virtual void fwdLanes(value_t* out, value_t const* const* in, int K) = 0;
+	virtual void bwdLanes(accum* const* adj, accum const* g, value_t const* const* in, value_t const* out, int K) = 0;
 	virtual void generateFwd(std::stringstream& ss, std::string const& old, std::string& comment) = 0;
 	virtual void generateBwd(std::stringstream& ss, int i, std::string const& old, expr const& result, std::string& comment) = 0;
+	virtual void emitFwd(NativeEmitter& em, expr const& result) = 0; // leaves the value in A
+	virtual void emitBwd(NativeEmitter& em, int i, void const* old, expr const& result) = 0; // leaves the contribution to the i-th parent in A
 	virtual std::string print(std::string l, std::string r) = 0;
 	virtual int getPrio() const = 0;
+	virtual std::string_view name() const = 0;
+	// print() with the marker \1 in place of every operand, in order
+	virtual std::string printPattern() { return print("\1", "\1"); }
+	// Calls into libm (exp, log, pow, ...), an order of magnitude more expensive than arithmetic
+	virtual bool transcendental() const { return false; }
 
 	std::string resolveValue(exprp_t const& p) {
 		if (p->flags & expr::constant)
@@ -79,23 +124,63 @@ struct operation {
 	}
 };
 struct grad1_fn : operation {
+	static constexpr int arity = 1;
 	grad1_fn(exprp_t l) {
 		parents = {l};
 	}
 };
 struct grad2_fn : operation {
+	static constexpr int arity = 2;
 	grad2_fn(exprp_t l, exprp_t r) {
 		parents = {l,r};
 	}
 };
+// Derives fwd/bwd and their lane versions from the scalar kernels f(x) and df(i, x) of Op,
+// where x holds the values of the parents. The lane loops are inlined and vectorize.
+template<class Op, class Base>
+struct kernelOp : Base {
+	using Base::Base;
+	calc fwd() override {
+		calc x[Base::arity];
+		for (int j = 0; j < Base::arity; ++j)
+			x[j] = this->parents[j]->value;
+		return static_cast<Op*>(this)->f(x);
+	}
+	calc bwd(int i) override {
+		calc x[Base::arity];
+		for (int j = 0; j < Base::arity; ++j)
+			x[j] = this->parents[j]->value;
+		return static_cast<Op*>(this)->df(i, x);
+	}
+	void fwdLanes(value_t* out, value_t const* const* in, int K) override {
+		auto& op = *static_cast<Op*>(this);
+		for (int k = 0; k < K; ++k) {
+			calc x[Base::arity];
+			for (int j = 0; j < Base::arity; ++j)
+				x[j] = in[j][k];
+			out[k] = op.f(x);
+		}
+	}
+	void bwdLanes(accum* const* adj, accum const* g, value_t const* const* in, value_t const*, int K) override {
+		auto& op = *static_cast<Op*>(this);
+		for (int k = 0; k < K; ++k) {
+			calc x[Base::arity];
+			for (int j = 0; j < Base::arity; ++j)
+				x[j] = in[j][k];
+			for (int i = 0; i < Base::arity; ++i)
+				if (adj[i])
+					adj[i][k] += g[k] * op.df(i, x);
+		}
+	}
+};
 
 // Implementations of all possible computations
-struct addGrad : public grad2_fn {
-	using grad2_fn::grad2_fn;
-	float fwd() override {
-		return parents[0]->value + parents[1]->value;
+struct addGrad : public kernelOp<addGrad, grad2_fn> {
+	using kernelOp::kernelOp;
+	calc f(calc const* x) const {
+		return x[0] + x[1];
 	}
-	float bwd(int) override {
+	calc df(int, calc const* x) const {
 		return 1;
 	}
 	void generateFwd(std::stringstream& ss, std::string const& old, std::string& comment) override {
@@ -108,15 +193,24 @@ struct addGrad : public grad2_fn {
 		ss << old;
 		comment = "+";
 	}
+	void emitFwd(NativeEmitter& em, expr const& result) override {
+		em.loadA(&parents[0]->value);
+		em.loadB(&parents[1]->value);
+		em.add();
+	}
+	void emitBwd(NativeEmitter& em, int, void const* old, expr const& result) override {
+		em.loadA(old);
+	}
 	std::string print(std::string l, std::string r) override { return l+" + "+r; }
 	int getPrio() const { return 1; }
+	std::string_view name() const override { return "add"; }
 };
-struct subGrad : public grad2_fn {
-	using grad2_fn::grad2_fn;
-	float fwd() override {
-		return parents[0]->value - parents[1]->value;
+struct subGrad : public kernelOp<subGrad, grad2_fn> {
+	using kernelOp::kernelOp;
+	calc f(calc const* x) const {
+		return x[0] - x[1];
 	}
-	float bwd(int i) override {
+	calc df(int i, calc const* x) const {
 		return 1-2*i;
 	}
 	void generateFwd(std::stringstream& ss, std::string const& old, std::string& comment) override {
@@ -129,16 +223,27 @@ struct subGrad : public grad2_fn {
 		ss << (i==0?old:"-"+old);
 		comment = i==0 ? ".-" : "-.";
 	}
+	void emitFwd(NativeEmitter& em, expr const& result) override {
+		em.loadA(&parents[0]->value);
+		em.loadB(&parents[1]->value);
+		em.sub();
+	}
+	void emitBwd(NativeEmitter& em, int i, void const* old, expr const& result) override {
+		em.loadA(old);
+		if (i)
+			em.negate();
+	}
 	std::string print(std::string l, std::string r) override { return l+" - "+r; }
 	int getPrio() const { return 1; }
+	std::string_view name() const override { return "sub"; }
 };
-struct mulGrad : public grad2_fn {
-	using grad2_fn::grad2_fn;
-	float fwd() override {
-		return parents[0]->value * parents[1]->value;
+struct mulGrad : public kernelOp<mulGrad, grad2_fn> {
+	using kernelOp::kernelOp;
+	calc f(calc const* x) const {
+		return x[0] * x[1];
 	}
-	float bwd(int i) override {
-		return parents[1-i]->value;
+	calc df(int i, calc const* x) const {
+		return x[1-i];
 	}
 	void generateFwd(std::stringstream& ss, std::string const& old, std::string& comment) override {
 		ss << fmt::format("{} * {}",
@@ -150,21 +255,27 @@ struct mulGrad : public grad2_fn {
 		ss << fmt::format("{}*v({})", old, (void*)(&parents[1-i]->value));
 		comment = i==0 ? ".*" : "*.";
 	}
+	void emitFwd(NativeEmitter& em, expr const& result) override {
+		em.loadA(&parents[0]->value);
+		em.loadB(&parents[1]->value);
+		em.mul();
+	}
+	void emitBwd(NativeEmitter& em, int i, void const* old, expr const& result) override {
+		em.loadA(old);
+		em.loadB(&parents[1-i]->value);
+		em.mul();
+	}
 	std::string print(std::string l, std::string r) override { return l+"*"+r; }
 	int getPrio() const { return 2; }
+	std::string_view name() const override { return "mul"; }
 };
-struct divGrad : public grad2_fn {
-	using grad2_fn::grad2_fn;
-	float fwd() override {
-		return parents[0]->value / parents[1]->value;
+struct divGrad : public kernelOp<divGrad, grad2_fn> {
+	using kernelOp::kernelOp;
+	calc f(calc const* x) const {
+		return x[0] / x[1];
 	}
-	float bwd(int i) override {
-		switch (i) {
-		case 0:
-			return 1.f/parents[1]->value;
-		default:
-			return -parents[0]->value/(parents[1]->value*parents[1]->value);
-		}
+	calc df(int i, calc const* x) const {
+		return i == 0 ? 1.f/x[1] : -x[0]/(x[1]*x[1]);
 	}
 	void generateFwd(std::stringstream& ss, std::string const& old, std::string& comment) override {
 		ss << fmt::format("{} / {}",
@@ -185,16 +296,35 @@ struct divGrad : public grad2_fn {
 			break;
 		}
 	}
+	void emitFwd(NativeEmitter& em, expr const& result) override {
+		em.loadA(&parents[0]->value);
+		em.loadB(&parents[1]->value);
+		em.div();
+	}
+	void emitBwd(NativeEmitter& em, int i, void const* old, expr const& result) override {
+		em.loadA(old);
+		if (i == 1) {
+			em.loadB(&parents[0]->value);
+			em.mul();
+			em.loadB(&parents[1]->value);
+			em.div();
+		}
+		em.loadB(&parents[1]->value);
+		em.div();
+		if (i == 1)
+			em.negate();
+	}
 	std::string print(std::string l, std::string r) override { return l+"/"+r; }
 	int getPrio() const { return 2; }
+	std::string_view name() const override { return "div"; }
 };
-struct sqrtGrad : public grad1_fn {
-	using grad1_fn::grad1_fn;
-	float fwd() override {
-		return std::sqrt(parents[0]->value);
+struct sqrtGrad : public kernelOp<sqrtGrad, grad1_fn> {
+	using kernelOp::kernelOp;
+	calc f(calc const* x) const {
+		return std::sqrt(x[0]);
 	}
-	float bwd(int) override {
-		return 0.5f/sqrt(parents[0]->value);
+	calc df(int, calc const* x) const {
+		return 0.5f/std::sqrt(x[0]);
 	}
 	void generateFwd(std::stringstream& ss, std::string const& old, std::string& comment) override {
 		ss << fmt::format("sqrt(v({0}))",
@@ -206,16 +336,28 @@ struct sqrtGrad : public grad1_fn {
 						  (void*)(&parents[0]->value));
 		comment = "sqrt";
 	}
+	void emitFwd(NativeEmitter& em, expr const& result) override {
+		em.loadA(&parents[0]->value);
+		em.sqrt();
+	}
+	void emitBwd(NativeEmitter& em, int, void const* old, expr const& result) override {
+		em.loadA(old);
+		em.loadB(&result.value);
+		em.div();
+		em.loadB(em.constant(0.5f));
+		em.mul();
+	}
 	std::string print(std::string l, std::string r) override { return "sqrt("+l+")"; }
 	int getPrio() const { return 0; }
+	std::string_view name() const override { return "sqrt"; }
 };
-struct expGrad : public grad1_fn {
-	using grad1_fn::grad1_fn;
-	float fwd() override {
-		return std::exp(parents[0]->value);
+struct expGrad : public kernelOp<expGrad, grad1_fn> {
+	using kernelOp::kernelOp;
+	calc f(calc const* x) const {
+		return std::exp(x[0]);
 	}
-	float bwd(int) override {
-		return std::exp(parents[0]->value);
+	calc df(int, calc const* x) const {
+		return std::exp(x[0]);
 	}
 	void generateFwd(std::stringstream& ss, std::string const& old, std::string& comment) override {
 		ss << fmt::format("exp(v({0}))",
@@ -226,20 +368,28 @@ struct expGrad : public grad1_fn {
 		ss << fmt::format("{0}*v({1})", old, (void*)(&result.value));
 		comment = "exp";
 	}
+	void emitFwd(NativeEmitter& em, expr const& result) override {
+		em.loadA(&parents[0]->value);
+		em.call(nativeExp);
+	}
+	void emitBwd(NativeEmitter& em, int, void const* old, expr const& result) override {
+		em.loadA(old);
+		em.loadB(&result.value);
+		em.mul();
+	}
 	std::string print(std::string l, std::string r) override { return "Exp["+l+"]"; }
 	int getPrio() const { return 0; }
+	std::string_view name() const override { return "exp"; }
+	bool transcendental() const override { return true; }
 };
-struct powcGrad : public operation {
-	float exponent;
-	powcGrad(exprp_t l, float r) {
-		parents = {l};
-		exponent = r;
-	}
-	float fwd() override {
-		return std::pow(parents[0]->value,exponent);
+struct powcGrad : public kernelOp<powcGrad, grad1_fn> {
+	calc exponent;
+	powcGrad(exprp_t l, calc r) : kernelOp(l), exponent{r} {}
+	calc f(calc const* x) const {
+		return std::pow(x[0], exponent);
 	}
-	float bwd(int) override {
-		return exponent * std::pow(parents[0]->value, exponent-1);
+	calc df(int, calc const* x) const {
+		return exponent * std::pow(x[0], exponent-1);
 	}
 	void generateFwd(std::stringstream& ss, std::string const& old, std::string& comment) override {
 		if(exponent==2)
@@ -255,19 +405,40 @@ struct powcGrad : public operation {
 			ss << fmt::format("{2}*{1}*pow(v({0}),{1}-1)", (void*)(&parents[0]->value), exponent,old);
 		comment = ".^"+std::to_string(exponent);
 	}
+	void emitFwd(NativeEmitter& em, expr const& result) override {
+		em.loadA(&parents[0]->value);
+		if (exponent == 2) {
+			em.loadB(&parents[0]->value);
+			em.mul();
+		}
+		else {
+			em.loadB(em.constant(exponent));
+			em.call(nativePow);
+		}
+	}
+	void emitBwd(NativeEmitter& em, int, void const* old, expr const& result) override {
+		em.loadA(&parents[0]->value);
+		if (exponent != 2) {
+			em.loadB(em.constant(exponent-1));
+			em.call(nativePow);
+		}
+		em.loadB(em.constant(exponent));
+		em.mul();
+		em.loadB(old);
+		em.mul();
+	}
 	std::string print(std::string l, std::string r) override { return l + "^" + tostr(exponent); }
 	int getPrio() const { return 3; }
+	std::string_view name() const override { return "powc"; }
+	bool transcendental() const override { return exponent != 2; }
 };
-struct powGrad : public grad2_fn {
-	using grad2_fn::grad2_fn;
-	float fwd() override {
-		return std::pow(parents[0]->value, parents[1]->value);
+struct powGrad : public kernelOp<powGrad, grad2_fn> {
+	using kernelOp::kernelOp;
+	calc f(calc const* x) const {
+		return std::pow(x[0], x[1]);
 	}
-	float bwd(int i) override {
-		switch (i) {
-		case 0:	return parents[1]->value * std::pow(parents[0]->value, parents[1]->value-1);
-		case 1: return std::pow(parents[0]->value, parents[1]->value) * std::log(parents[0]->value);
-		}
+	calc df(int i, calc const* x) const {
+		return i == 0 ? x[1] * std::pow(x[0], x[1]-1) : std::pow(x[0], x[1]) * std::log(x[0]);
 	}
 	void generateFwd(std::stringstream& ss, std::string const& old, std::string& comment) override {
 		ss << fmt::format("pow(v({0}),v({1}))", (void*)(&parents[0]->value), (void*)(&parents[1]->value));
@@ -285,8 +456,136 @@ struct powGrad : public grad2_fn {
 			break;
 		}
 	}
+	void emitFwd(NativeEmitter& em, expr const& result) override {
+		em.loadA(&parents[0]->value);
+		em.loadB(&parents[1]->value);
+		em.call(nativePow);
+	}
+	void emitBwd(NativeEmitter& em, int i, void const* old, expr const& result) override {
+		switch (i) {
+		case 0:
+			em.loadA(&parents[1]->value);
+			em.loadB(em.constant(1));
+			em.sub();
+			em.moveAtoB();
+			em.loadA(&parents[0]->value);
+			em.call(nativePow);
+			em.loadB(&parents[1]->value);
+			break;
+		case 1:
+			em.loadA(&parents[0]->value);
+			em.call(nativeLog);
+			em.loadB(&result.value);
+			break;
+		}
+		em.mul();
+		em.loadB(old);
+		em.mul();
+	}
 	std::string print(std::string l, std::string r) override { return l + "^" + r; }
 	int getPrio() const { return 3; }
+	std::string_view name() const override { return "pow"; }
+	bool transcendental() const override { return true; }
+};
+
+// Leaf operation drawing from a counter-based generator, a new draw per randomStream::advance()
+struct randomGrad : public operation {
+	randomStream* rs;
+	uint32_t stream;
+	bool normal;
+	randomGrad(randomStream& r, bool n) : rs{&r}, stream{r.nextStream++}, normal{n} {}
+	calc fwd() override {
+		return normal ? rngNormal(rs->seed, rs->step, stream, 0) : rngUniform(rs->seed, rs->step, stream, 0);
+	}
+	calc bwd(int) override {
+		return 0;
+	}
+	void fwdLanes(value_t* out, value_t const* const*, int K) override { // independent noise per lane
+		for (int k = 0; k < K; ++k)
+			out[k] = normal ? rngNormal(rs->seed, rs->step, stream, k) : rngUniform(rs->seed, rs->step, stream, k);
+	}
+	void bwdLanes(accum* const*, accum const*, value_t const* const*, value_t const*, int) override {}
+	void generateFwd(std::stringstream& ss, std::string const& old, std::string& comment) override {
+		ss << fmt::format("{}(vu64({}), vu64({}), {}u, 0u)", normal ? "rngNormal" : "rngUniform",
+						  (void*)&rs->seed, (void*)&rs->step, stream);
+		comment = normal ? "N" : "U";
+	}
+	void generateBwd(std::stringstream& ss, int, std::string const& old, expr const& result, std::string& comment) override {}
+	void emitFwd(NativeEmitter& em, expr const& result) override {
+		em.call(+[](void const* p) -> float { return ((randomGrad*)p)->fwd(); }, this);
+	}
+	void emitBwd(NativeEmitter& em, int, void const* old, expr const& result) override {}
+	std::string print(std::string l, std::string r) override { return fmt::format("{}[{}]", normal ? "N" : "U", stream); }
+	int getPrio() const { return 0; }
+	std::string_view name() const override { return normal ? "randomNormal" : "randomUniform"; }
+	bool transcendental() const override { return true; }
+};
+
+// A node of an op from the opRegistry (see opKernels.hpp): the interpreter and the generated C
+// call the same kernels, native code calls back into them.
+struct registeredOp : public operation {
+	opInfo const* info;
+	std::vector<calc> x; // operand values
+	struct nativeArg { registeredOp* op; int i; expr const* result; };
+	std::deque<nativeArg> nativeArgs; // arguments of the native derivative calls, stable addresses
+
+	registeredOp(opInfo const& info, std::vector<exprp_t> operands) : info{&info}, x(operands.size()) {
+		parents = std::move(operands);
+	}
+	calc const* gather() {
+		for (int j = 0; j < parents.size(); ++j)
+			x[j] = parents[j]->value;
+		return x.data();
+	}
+	std::string operands() {
+		std::string s;
+		for (auto& p : parents)
+			s += (s.empty() ? "" : ", ") + resolveValue(p);
+		return s;
+	}
+	calc fwd() override {
+		return info->f(gather(), x.size());
+	}
+	calc bwd(int i) override {
+		gather();
+		return info->df(i, x.data(), x.size(), result ? calc(result->value) : info->f(x.data(), x.size()));
+	}
+	void fwdLanes(value_t* out, value_t const* const* in, int K) override {
+		info->fLanes(out, in, x.size(), K);
+	}
+	void bwdLanes(accum* const* adj, accum const* g, value_t const* const* in, value_t const* out, int K) override {
+		info->dfLanes(adj, g, in, out, x.size(), K);
+	}
+	void generateFwd(std::stringstream& ss, std::string const& old, std::string& comment) override {
+		ss << fmt::format("{}F((const calc[]){{{}}}, {})", info->name, operands(), x.size());
+		comment = info->name;
+	}
+	void generateBwd(std::stringstream& ss, int i, std::string const& old, expr const& result, std::string& comment) override {
+		ss << fmt::format("{}*{}Df({}, (const calc[]){{{}}}, {}, v({}))", old, info->name, i, operands(), x.size(), (void*)&result.value);
+		comment = info->name;
+	}
+	void emitFwd(NativeEmitter& em, expr const& result) override {
+		em.call(+[](void const* p) -> float { return ((registeredOp*)p)->fwd(); }, this);
+	}
+	void emitBwd(NativeEmitter& em, int i, void const* old, expr const& result) override {
+		auto& arg = nativeArgs.emplace_back(this, i, &result);
+		em.call(+[](void const* p) -> float {
+			auto a = (nativeArg const*)p;
+			return a->op->info->df(a->i, a->op->gather(), a->op->x.size(), a->result->value);
+		}, &arg);
+		em.loadB(old);
+		em.mul();
+	}
+	std::string print(std::string l, std::string r) override { return fmt::format("{}({}, {})", info->name, l, r); }
+	std::string printPattern() override {
+		std::string s = fmt::format("{}(", info->name);
+		for (int j = 0; j < parents.size(); ++j)
+			s += j ? ", \1" : "\1";
+		return s + ")";
+	}
+	int getPrio() const { return 0; }
+	std::string_view name() const override { return info->name; }
+	bool transcendental() const override { return info->transcendental; }
 };
 
 
@@ -296,7 +595,7 @@ class dual {
 	cfwdfunc_t* fwdFunc = nullptr;
 	cbwdfunc_t* bwdFunc = nullptr;
 public:
-	dual(float v = 0, bool requiresGrad = false) {
+	dual(calc v = 0, bool requiresGrad = false) {
 		ex = std::make_shared<expr>(v, 0, nullptr, requiresGrad, !requiresGrad);
 	}
 	dual(operation* op) {
@@ -304,17 +603,70 @@ public:
 		bool requiresGrad = false;
 		for (auto const& p : op->parents) requiresGrad |= p->requiresGrad;
 		ex = std::make_shared<expr>(op->fwd(), 0, op, requiresGrad, false);
+		op->result = ex.get();
 	}
 
-	float& value() { return ex->value; }
-	const float& value() const { return ex->value; }
-	float& grad() { return ex->grad; }
-	const float& grad() const { return ex->grad; }
+	// A leaf that is neither constant nor differentiated, its value is fed before each update()/updateC(),
+	// so the same (compiled) graph can be reused for new data.
+	static dual placeholder(std::string const& name = "") {
+		dual d;
+		d.ex->flags = expr::placeholder;
+		if (!name.empty())
+			d.setVarName(name);
+		return d;
+	}
+	// Random leaves, they draw new numbers after rs.advance() without any change to the graph
+	static dual randomNormal(randomStream& rs) {
+		return dual(new randomGrad(rs, true));
+	}
+	static dual randomUniform(randomStream& rs) {
+		return dual(new randomGrad(rs, false));
+	}
+	// A registered op looked up by name
+	static dual apply(std::string_view name, std::vector<dual> const& operands) {
+		auto* info = opRegistry::find(name);
+		if (!info) {
+			std::cout << fmt::format("ERROR: no op {} registered\n", name);
+			return dual();
+		}
+		return apply(*info, operands);
+	}
+	// One node of a registered op, or a constant if all operands are constants
+	static dual apply(opInfo const& info, std::vector<dual> const& operands) {
+		if (info.arity >= 0 ? operands.size() != info.arity : operands.empty()) {
+			std::cout << fmt::format("ERROR: {} takes {} operands, not {}\n", info.name, info.arity, operands.size());
+			return dual();
+		}
+		bool allConstant = true;
+		for (auto& o : operands)
+			allConstant &= (o.ex->flags & expr::constant) != 0;
+		if (info.foldConstants && allConstant) {
+			std::vector<calc> x;
+			for (auto& o : operands)
+				x.push_back(o.ex->value);
+			return dual(info.f(x.data(), x.size()));
+		}
+		std::vector<exprp_t> exprs;
+		for (auto& o : operands)
+			exprs.push_back(o.ex);
+		return dual(new registeredOp(info, std::move(exprs)));
+	}
+	bool isPlaceholder() const {
+		return ex->flags & expr::placeholder;
+	}
+
+	value_t& value() { return ex->value; }
+	const value_t& value() const { return ex->value; }
+	accum& grad() { return ex->grad; }
+	const accum& grad() const { return ex->grad; }
 	std::string getVarName() const {
 		return ex->getVarName();
 	}
+	expr* getExpr() const {
+		return ex.get();
+	}
 	void setVarName(std::string const& name) {
-		expr::namedict.insert(std::make_pair(ex.get(), name));
+		ex->nameId = expr::names.intern(name);
 	}
 	
 	bool getRequiresGrad() const {
@@ -330,36 +682,70 @@ public:
 		AutoTimer at(g_timer, _FUNC_);
 		ex->update();
 	}
-	void backward(float gradient = 1.f) {
+	void backward(accum gradient = 1) {
 		AutoTimer at(g_timer, _FUNC_);
 		ex->backward(gradient);
 	}
-	void compile(DynamicLoader& dl) {
+	// Graphs with more nodes than this are split into chunk functions by default. gcc's time grows
+	// much faster than linear with the size of a function, small chunks keep the build linear.
+	static constexpr int autoChunkThreshold = 256, defaultChunkSize = 64;
+	// chunkSize: number of statements per chunk function, 0 = one function, -1 = automatic
+	// bwdEpilogue: code run at the end of the backward kernel, e.g. a fused optimizer step
+	void compile(DynamicLoader& dl, int chunkSize = -1, std::string const& bwdEpilogue = "") {
 		AutoTimer at(g_timer, _FUNC_);
-		{
-			std::set<expr const*> visited;
-			std::stringstream fwdCode;
-			fwdCode << fmt::format("float v;\n");
-			ex->generateUpdate(fwdCode, visited);
-			fwdCode << fmt::format("return v;\n"); 
-			fwdFunc = dl.addFunction<cfwdfunc_t>("forward", fwdCode.str());
+		auto plan = expr::buildPlan({ex.get()});
+		if (chunkSize < 0)
+			chunkSize = plan.size() > autoChunkThreshold ? defaultChunkSize : 0;
+		auto [fwdBody, bwdBody] = expr::generateKernelBodies(dl, {ex.get()}, plan, chunkSize);
+		fwdFunc = dl.addFunction<cfwdfunc_t>(dl.uniqueName("forward"), fmt::format("{}return v({});\n", fwdBody, (void*)&ex->value));
+		bwdFunc = dl.addFunction<cbwdfunc_t>(dl.uniqueName("backward"), fmt::format("va({}) = gradient;\n{}{}", (void*)&ex->adjoint, bwdBody, bwdEpilogue));
+		dl.compileAndLoad();
+	}
+	// Lowers the graph straight to machine code, no external compiler is involved
+	void compileNative(NativeEmitter& em) {
+		AutoTimer at(g_timer, _FUNC_);
+		if (!nativeKernels) {
+			std::cout << "ERROR: native kernels need float values and gradients\n";
+			return;
 		}
-		{
-			std::set<expr const*> visited;
-			std::stringstream bwdCode;
-			ex->generateBackward(bwdCode, visited);
-			bwdFunc = dl.addFunction<cbwdfunc_t>("backward", bwdCode.str());
+		auto plan = expr::buildPlan({ex.get()});
+		fwdFunc = em.beginForward();
+		for (auto* e : plan)
+			if (e->op)
+				e->emitFwdStatement(em);
+		em.loadA(&ex->value);
+		em.endFunction();
+
+		bwdFunc = em.beginBackward();
+		em.storeA(&ex->adjoint);
+		std::set<expr const*> seeded = {ex.get()};
+		for (auto it = plan.rbegin(); it != plan.rend(); ++it)
+			if ((*it)->op && (*it)->needsGrad())
+				(*it)->emitBwdStatements(em, seeded);
+		if (!ex->op) {
+			em.loadB(&ex->grad);
+			em.add();
+			em.storeA(&ex->grad);
 		}
-		dl.compileAndLoad();
+		em.endFunction();
+		em.finalize();
 	}
 	void updateC() {
 		AutoTimer at(g_timer, _FUNC_);
 		ex->value = (*fwdFunc)();
 	}
-	void backwardC(float gradient = 1.f) {
+	void backwardC(accum gradient = 1) {
 		AutoTimer at(g_timer, _FUNC_);
 		(*bwdFunc)(gradient);
 	}
+	// The kernels run by updateC()/backwardC(), to switch back to kernels built earlier
+	// while their loader or emitter is alive
+	struct kernels { cfwdfunc_t* fwd; cbwdfunc_t* bwd; };
+	kernels getKernels() const { return {fwdFunc, bwdFunc}; }
+	void setKernels(kernels k) {
+		fwdFunc = k.fwd;
+		bwdFunc = k.bwd;
+	}
 
 
 	nodeCountInfo getNumNodes() const {
@@ -372,7 +758,7 @@ public:
 	}
 	
 
-	dual& operator=(float v) {
+	dual& operator=(calc v) {
 		ex->value = v;
 		return *this;
 	}
@@ -396,7 +782,7 @@ public:
 	friend dual exp(dual const& l) {
 		return dual(new expGrad(l.ex));
 	}
-	friend dual pow(dual const& l, float r) {
+	friend dual pow(dual const& l, calc r) {
 		return dual(new powcGrad(l.ex, r));
 	}
 	friend dual pow(dual const& l, dual const& r) {
@@ -405,6 +791,20 @@ public:
 };
 
 
+// Fused ops, one node each
+inline dual log(dual const& x) { return dual::apply(logOp, {x}); }
+inline dual sigmoid(dual const& x) { return dual::apply(sigmoidOp, {x}); }
+inline dual tanh(dual const& x) { return dual::apply(tanhOp, {x}); }
+inline dual softplus(dual const& x) { return dual::apply(softplusOp, {x}); }
+inline dual logSumExp(std::vector<dual> const& xs) { return dual::apply(logSumExpOp, xs); }
+inline dual squaredError(dual const& a, dual const& b) { return dual::apply(squaredErrorOp, {a, b}); }
+
+// Writes the next values into placeholders, e.g. the rows of a mini-batch
+inline void feed(std::vector<dual>& placeholders, std::vector<calc> const& values) {
+	for (int i = 0; auto& p : placeholders)
+		p = values[i++];
+}
+
 // Implementations
 void expr::update() {
 	if (op) {
@@ -413,7 +813,7 @@ void expr::update() {
 		value = op->fwd();
 	}
 }
-void expr::backward(float gradient) {
+void expr::backward(accum gradient) {
 	grad += gradient;
 	if (op)  // if I am the result of an operation
 		for (int i = 0; const auto& p : op->parents) { // iteration over all the operands
@@ -422,51 +822,175 @@ void expr::backward(float gradient) {
 			++i;
 		}
 }
-void expr::generateUpdate(std::stringstream& ss, std::set<expr const*>& visited) {
-	if (op) {
-		bool vis = visited.contains(this);
-		visited.insert(this);
-		if (vis)
-			return; // The graph has a circle and we have computed this value already
-		for (int i = 0; const auto& p : op->parents)
-			p->generateUpdate(ss, visited);
-		std::string comment;
-		ss << fmt::format("v=v({}) = ", (void*)&value); 
-		op->generateFwd(ss, "unused", comment);
-		ss << ";" << (comment.empty() ? "" : " //"+comment) << "\n"; 
+void expr::generateFwdStatement(std::stringstream& ss) {
+	std::string comment;
+	ss << fmt::format("sv({}, ", (void*)&value);
+	op->generateFwd(ss, "unused", comment);
+	ss << ");" << (comment.empty() ? "" : " //"+comment) << "\n";
+}
+// Reverse sweep step for one node of the plan: its adjoint is complete, so it is added to the
+// own gradient and propagated to the operands. The first contribution to an operand's adjoint
+// assigns instead of accumulating, which saves clearing all adjoints before every call.
+void expr::generateBwdStatements(std::stringstream& ss, std::set<expr const*>& seeded) {
+	std::string old = fmt::format("va({})", (void*)&adjoint);
+	ss << fmt::format("va({}) += {};\n", (void*)&grad, old);
+	for (int i = 0; const auto& p : op->parents) {
+		if (p->needsGrad()) {
+			std::string comment;
+			if (!p->op)
+				ss << fmt::format("va({}) += ", (void*)&p->grad);
+			else
+				ss << fmt::format("va({}) {}= ", (void*)&p->adjoint, seeded.insert(p.get()).second ? "" : "+");
+			op->generateBwd(ss, i, old, *this, comment);
+			ss << ";" << (comment.empty() ? "" : " //"+comment) << "\n";
+		}
+		++i;
 	}
 }
-void expr::generateBackward(std::stringstream& ss, std::set<expr const*>& visited) {
-	ss << fmt::format("v({}) += gradient;\n", (void*)&grad);
-	if (op) {
-		bool vis = visited.contains(this);
-		visited.insert(this);
-		std::string old = fmt::format("g{}", (void*)this);
-		if (!vis)
-			ss << "float ";
-		ss << fmt::format("{} = gradient; \n", old);
-		for (int i = 0; const auto& p : op->parents) {
-			if (p->requiresGrad) {
-				ss << fmt::format("gradient = ");
-				std::string comment;
-				op->generateBwd(ss, i, old, *this, comment);
-				ss << ";" << (comment.empty() ? "" : " //"+comment) << "\n";
-				p->generateBackward(ss, visited);
+void expr::emitFwdStatement(NativeEmitter& em) {
+	op->emitFwd(em, *this);
+	em.storeA(&value);
+}
+// Same reverse sweep step as generateBwdStatements
+void expr::emitBwdStatements(NativeEmitter& em, std::set<expr const*>& seeded) {
+	em.loadA(&adjoint);
+	em.loadB(&grad);
+	em.add();
+	em.storeA(&grad);
+	for (int i = 0; const auto& p : op->parents) {
+		if (p->needsGrad()) {
+			op->emitBwd(em, i, &adjoint, *this);
+			accum* target = p->op ? &p->adjoint : &p->grad;
+			if (p->op && seeded.insert(p.get()).second)
+				em.storeA(target);
+			else {
+				em.loadB(target);
+				em.add();
+				em.storeA(target);
 			}
-			++i;
 		}
+		++i;
 	}
 }
+// Returns all nodes reachable from the roots, every node after its operands.
+// Iterative, so deep graphs do not overflow the stack.
+std::vector<expr*> expr::buildPlan(std::vector<expr*> const& roots) {
+	std::vector<expr*> plan;
+	std::unordered_set<expr const*> visited;
+	std::vector<std::pair<expr*, size_t>> stack;
+	for (auto* r : roots) {
+		if (visited.insert(r).second)
+			stack.emplace_back(r, 0);
+		while (!stack.empty()) {
+			auto& [e, i] = stack.back();
+			if (e->op && i < e->op->parents.size()) {
+				expr* p = e->op->parents[i++].get();
+				if (visited.insert(p).second)
+					stack.emplace_back(p, 0);
+			}
+			else {
+				plan.push_back(e);
+				stack.pop_back();
+			}
+		}
+	}
+	return plan;
+}
+// Forward and reverse sweep over the plan of one or more roots, for the bodies of the top-level
+// kernels. With chunkSize > 0 the statements are spread over chunk functions <name>_f<n>/<name>_b<n>
+// and the bodies only call them. The backward body expects the seeds in the adjoints of the roots.
+// Chunks are fragments of the loader, identified by their code without the node addresses. So the
+// chunks of a graph rebuilt with the same structure, and of the unchanged part of an edited graph,
+// come out the same and are not compiled again. For that the boundaries are placed by content as
+// well: a chunk ends after a statement whose hash (addresses left out) hits, an insertion only
+// changes the chunks around it.
+std::pair<std::string, std::string> expr::generateKernelBodies(DynamicLoader& dl,
+	std::vector<expr*> const& roots, std::vector<expr*> const& plan, int chunkSize) {
+	auto emitChunks = [&](auto&& generate) {
+		std::string calls;
+		std::stringstream code, statement;
+		int nStatements = 0;
+		auto flush = [&]() {
+			calls += dl.addFragment(code.str());
+			code.str("");
+			nStatements = 0;
+		};
+		// Between half and twice the chunk size, chunkSize on average
+		const int minSize = std::max(1, chunkSize/2);
+		std::vector<void*> addresses;
+		generate(statement, [&]() {
+			auto s = statement.str();
+			statement.str("");
+			code << s;
+			if (chunkSize <= 0)
+				return;
+			addresses.clear();
+			uint64_t h = 14695981039346656037ull; // FNV-1a
+			for (char c : DynamicLoader::parameterize(s, addresses))
+				h = (h ^ (unsigned char)c) * 1099511628211ull;
+			if (++nStatements >= minSize && (h % minSize == 0 || nStatements >= 2*chunkSize))
+				flush();
+		});
+		if (chunkSize <= 0)
+			return code.str();
+		if (nStatements)
+			flush();
+		return calls;
+	};
+
+	auto fwd = emitChunks([&](std::stringstream& code, auto&& next) {
+		for (auto* e : plan) {
+			if (!e->op)
+				continue;
+			e->generateFwdStatement(code);
+			next();
+		}
+	});
+	auto bwd = emitChunks([&](std::stringstream& code, auto&& next) {
+		// The roots hold their seeds already, so contributions from other roots accumulate
+		std::set<expr const*> seeded(roots.begin(), roots.end());
+		for (auto it = plan.rbegin(); it != plan.rend(); ++it) {
+			if (!(*it)->op || !(*it)->needsGrad())
+				continue;
+			(*it)->generateBwdStatements(code, seeded);
+			next();
+		}
+	});
+	for (auto* r : roots) // leaves have no plan statements
+		if (!r->op)
+			bwd += fmt::format("va({}) += va({});\n", (void*)&r->grad, (void*)&r->adjoint);
+	return {fwd, bwd};
+}
 
 void expr::countElems(nodeCountInfo& counter) const {
-	++counter.nNodes;
-	if(flags & constant)
-		++counter.nConstants;
-	if (flags & requiresGrad)
-		++counter.nReqGrad;
-	if (op)
-		for (const auto& p : op->parents)
-			p->countElems(counter);
+	auto plan = buildPlan({const_cast<expr*>(this)});
+	std::unordered_map<expr const*, int> depths;
+	std::unordered_map<expr const*, double> treeSizes;
+	for (auto* e : plan) {
+		++counter.nNodes;
+		if (e->flags & constant)
+			++counter.nConstants;
+		if (e->flags & requiresGrad)
+			++counter.nReqGrad;
+		if (e->flags & placeholder)
+			++counter.nPlaceholders;
+		int depth = 0;
+		double treeSize = 1;
+		if (e->op) {
+			++counter.nOps;
+			++counter.opCounts[e->op->name()];
+			if (e->op->transcendental())
+				++counter.nTranscendental;
+			for (const auto& p : e->op->parents) {
+				depth = std::max(depth, depths[p.get()] + 1);
+				treeSize += treeSizes[p.get()];
+			}
+		}
+		depths[e] = depth;
+		treeSizes[e] = treeSize;
+	}
+	counter.depth = depths[this];
+	counter.nTreeNodes = treeSizes[this];
 }
 int expr::getPrio() const {
 	if (op)
@@ -474,19 +998,73 @@ int expr::getPrio() const {
 	return 999;
 }
 std::string expr::printExpr() const {
-	if (op) {
-		auto pl = op->parents[0];
-		auto l = pl->printExpr(); if (pl->getPrio() <= getPrio()) l = bracket(l);
-		std::string r;
-		if (op->parents.size()>1) {
-			auto pr = op->parents[1];
-			r = pr->printExpr(); if (pr->getPrio() <= getPrio()) r = bracket(r);
+	std::string s;
+	printExpr(std::back_inserter(s));
+	return s;
+}
+// Streams the expression without recursion. Operation nodes used more than once are printed
+// once as 'let $k = ...;' and referenced by name afterwards, so the output stays linear in the
+// size of the DAG instead of the number of paths through it.
+template<class OutputIt>
+OutputIt expr::printExpr(OutputIt out) const {
+	auto plan = buildPlan({const_cast<expr*>(this)});
+	std::unordered_map<expr const*, int> uses, bindings;
+	for (auto* e : plan)
+		if (e->op)
+			for (auto& p : e->op->parents)
+				++uses[p.get()];
+
+	auto write = [&](std::string_view sv) { out = std::copy(sv.begin(), sv.end(), out); };
+	struct task { expr const* e; std::string text; };
+	std::vector<task> stack;
+	auto print = [&](expr const* top) {
+		stack.push_back({top});
+		while (!stack.empty()) {
+			task t = std::move(stack.back());
+			stack.pop_back();
+			if (!t.e)
+				write(t.text);
+			else if (!t.e->op) {
+				auto& name = t.e->getVarName();
+				write(name.empty() ? tostr(t.e->value) : name);
+			}
+			else if (t.e != top && bindings.contains(t.e))
+				write(fmt::format("${}", bindings[t.e]));
+			else {
+				// The operation prints a pattern with a marker per operand, the operands are streamed in between
+				auto& ps = t.e->op->parents;
+				std::string pattern = t.e->op->printPattern();
+				auto operand = [&](int i) -> std::vector<task> {
+					expr const* p = ps[i].get();
+					bool named = p->op && bindings.contains(p);
+					if (!named && p->getPrio() <= t.e->getPrio())
+						return {{nullptr, ")"}, {p}, {nullptr, "("}};
+					return {{p}};
+				};
+				std::vector<size_t> markers;
+				for (size_t i = pattern.find('\1'); i != std::string::npos && markers.size() < ps.size(); i = pattern.find('\1', i+1))
+					markers.push_back(i);
+				std::vector<task> parts; // in reverse order
+				for (int i = (int)markers.size()-1; i >= 0; --i) {
+					parts.push_back({nullptr, pattern.substr(markers[i]+1)});
+					for (auto& o : operand(i)) parts.push_back(std::move(o));
+					pattern.resize(markers[i]);
+				}
+				parts.push_back({nullptr, pattern});
+				for (auto& p : parts)
+					stack.push_back(std::move(p));
+			}
+		}
+	};
+	for (auto* e : plan) {
+		if (e->op && uses[e] > 1) {
+			int k = bindings.size() + 1;
+			write(fmt::format("let ${} = ", k));
+			print(e);
+			write(";\n");
+			bindings[e] = k;
 		}
-		return op->print(l, r);
-	}
-	else {
-		//return std::format("{}",(void*)this);
-		std::string s = getVarName();
-		return s.empty() ? tostr(value) : s;
 	}
+	print(this);
+	return out;
 }
@@ -1,6 +1,13 @@
 ﻿#pragma once
 #include <vector>
 #include <map>
+#include <unordered_map>
+#include <deque>
+#include <string>
+#include <cctype>
+#include <cstdint>
+#include <thread>
+#include <cstdio>
 
 #if defined _WIN32
 	#define WIN32_LEAN_AND_MEAN
@@ -19,9 +26,20 @@
 		if (!FreeLibrary((HMODULE)library))
 			std::cout << "ERROR: free lib\n";
 	}
+	int processId(){
+		return (int)GetCurrentProcessId();
+	}
+	FILE* openPipe(std::string const& cmd){
+		return _popen(cmd.c_str(), "w");
+	}
+	int closePipe(FILE* pipe){
+		return _pclose(pipe);
+	}
 	std::string exportSpec = "__declspec(dllexport) ", libExp = ".lib", sharedLibExp = ".dll";
 #else
 	#include <dlfcn.h>
+	#include <unistd.h>
+	#include <sys/mman.h>
 	void* loadLibrary(std::string str){
 		auto* l = dlopen(str.c_str(), RTLD_LAZY);
 		if (!l)
@@ -35,56 +53,254 @@
 		if (dlclose(library))
 			fmt::print("ERROR: lib freeing: {}\n", dlerror());
 	}
+	int processId(){
+		return getpid();
+	}
+	FILE* openPipe(std::string const& cmd){
+		return popen(cmd.c_str(), "w");
+	}
+	int closePipe(FILE* pipe){
+		return pclose(pipe);
+	}
 	#define __cdecl __attribute__((__cdecl__))
 
 	std::string exportSpec = "", libExp = ".o", sharedLibExp = ".so";
 #endif
 
 
-typedef float(__cdecl* cfwdfunc_t)();
-typedef void(__cdecl* cbwdfunc_t)(float);
+typedef calc(__cdecl* cfwdfunc_t)();
+typedef void(__cdecl* cbwdfunc_t)(accum);
+typedef void(__cdecl* cseedfunc_t)(accum const*); // backward with one seed gradient per output
 
 class DynamicLoader {
 	std::string fileName = "_grad";
+	std::string prelude; // everything but the op kernels, those are taken from the registry when compiling
 	std::string entireCode;
+	std::vector<std::string> units; // extra translation units holding chunk functions
+	int nUnits = std::max(1u, std::thread::hardware_concurrency());
+	int nChunks = 0;
+	int nSymbols = 0;
 	std::map<std::string, cfwdfunc_t*> fwdfuncs;
 	std::map<std::string, cbwdfunc_t*> bwdfuncs;
-	void* library = nullptr;
+	std::map<std::string, cseedfunc_t*> seedfuncs;
+	std::vector<std::string> pending; // functions added since the last compileAndLoad
+	std::vector<void*> libraries;     // one per compileAndLoad, all stay loaded until the loader is destroyed
+	using fragmentKey = std::pair<uint64_t, uint64_t>; // two independent hashes of the code without its addresses
+	std::map<fragmentKey, void*> fragments;             // -> chunk function in a loaded library
+	std::map<fragmentKey, std::string> pendingFragments; // -> name, built by the next compileAndLoad
+	std::deque<std::vector<void*>> addressTables;       // the addresses passed by every fragment call
+	int nReused = 0;
+
+	// Streams source code into the stdin of a compiler command, returns false on failure
+	static bool runCompiler(std::string const& cmd, std::string const& source) {
+		FILE* pipe = openPipe(cmd);
+		if (!pipe) {
+			std::cout << "ERROR: starting compiler: " << cmd << "\n";
+			return false;
+		}
+		fwrite(source.data(), 1, source.size(), pipe);
+		if (closePipe(pipe)) {
+			std::cout << "ERROR: compiling: " << cmd << "\n";
+			return false;
+		}
+		return true;
+	}
+#if defined(__linux__)
+	std::vector<int> libraryFds;
+	// Compiles and links entirely in anonymous memory files, nothing touches the working directory.
+	// The memfds are inherited by the compiler processes, which write to them via /proc/self/fd.
+	void* buildInMemory(std::vector<std::string> const& sources, std::string const& compiler, std::string const& args) {
+		auto fdPath = [](int fd) { return fmt::format("/proc/self/fd/{}", fd); };
+		int libFd = memfd_create("_grad.so", 0);
+		bool ok = true;
+		if (sources.size() == 1)
+			ok = runCompiler(fmt::format("{} {} -fPIC -shared -x c -o {} - -lm", compiler, args, fdPath(libFd)), sources[0]);
+		else {
+			std::vector<int> objFds;
+			std::vector<std::thread> compilers;
+			std::vector<char> unitOk(sources.size());
+			std::string objects;
+			for (int i = 0; i < sources.size(); ++i) {
+				objFds.push_back(memfd_create("_grad.o", 0));
+				objects += " " + fdPath(objFds.back());
+			}
+			for (int i = 0; i < sources.size(); ++i)
+				compilers.emplace_back([&, i]() {
+					unitOk[i] = runCompiler(fmt::format("{} {} -fPIC -c -x c -o {} -", compiler, args, fdPath(objFds[i])), sources[i]);
+				});
+			for (auto& t : compilers)
+				t.join();
+			std::cout << fmt::format("Created {} objects\n", sources.size());
+			ok = std::ranges::all_of(unitOk, [](char c) { return c; })
+				&& !system(fmt::format("{} {} -shared -o {}{} -lm", compiler, args, fdPath(libFd), objects).c_str());
+			for (int fd : objFds)
+				close(fd);
+		}
+		void* lib = ok ? loadLibrary(fdPath(libFd)) : nullptr;
+		// dlopen identifies libraries by path, the fd stays open so the next library gets another one
+		if (lib)
+			libraryFds.push_back(libFd);
+		else
+			close(libFd);
+		return lib;
+	}
+#endif
+	void* buildOnDisk(std::string const& fileName, std::vector<std::string> const& sources, std::string const& compiler, std::string const& args) {
+		std::vector<std::string> unitNames;
+		for (int i = 0; i < sources.size(); ++i) {
+			unitNames.push_back(i ? fmt::format("{}_{}", fileName, i) : fileName);
+			std::ofstream file(unitNames[i]+".c");
+			file << sources[i];
+		}
+		// Every unit gets its own compiler process, gcc's optimization time grows superlinearly with function size
+		std::vector<std::thread> compilers;
+		std::string objects;
+		for (auto& name : unitNames) {
+			compilers.emplace_back([&, name]() {
+				system(fmt::format("{2} {0} -c -o {1}{3} {1}.c", args, name, compiler, libExp).c_str());
+			});
+			objects += fmt::format(" {}{}", name, libExp);
+		}
+		for (auto& t : compilers)
+			t.join();
+		std::cout << fmt::format("Created {} .lib\n", unitNames.size());
+
+		system(fmt::format("{2} {0} -shared -o {1}{4}{3}", args, fileName, compiler, objects, sharedLibExp).c_str());
+		std::cout << "Created .dll\n";
+		return loadLibrary(fmt::format("./{}{}", fileName, sharedLibExp));
+	}
 public:
+	bool dumpAssembly = false; // writes <fileName>.asm of the main unit
+	std::string flags = "-O3 -ffast-math"; // optimization flags of the next compileAndLoad
 	DynamicLoader(std::vector<std::string> const& includeHeaders) {
+		fileName += fmt::format("_{}", processId()); // processes sharing a working directory must not clash
 		for(auto& h : includeHeaders)
-			entireCode += fmt::format("#include <{}.h>\n", h);
-		entireCode += "#define v(x) (*((float*)(x)))\n";
+			prelude += fmt::format("#include <{}.h>\n", h);
+		prelude += "#define vu64(x) (*((unsigned long long*)(x)))\n";
+		prelude += "#include <math.h>\n" + scalarCode + rngCode + "\n";
 	}
 	~DynamicLoader() {
 		for (auto [k, v] : fwdfuncs)
 			delete v;
 		for (auto [k, v] : bwdfuncs)
 			delete v;
-		closeLibrary(library);
+		for (auto [k, v] : seedfuncs)
+			delete v;
+		for (auto* library : libraries)
+			closeLibrary(library);
+#if defined(__linux__)
+		for (int fd : libraryFds)
+			close(fd);
+#endif
+	}
+	// Every kernel gets its own symbol, so several graphs (or groups of outputs) can be
+	// compiled by the same loader without clashing
+	std::string uniqueName(std::string const& base) {
+		return fmt::format("{}_{}", base, nSymbols++);
 	}
 	template<typename T>
 	T* addFunction(std::string name, std::string code) {
+		pending.push_back(name);
 		if(std::is_same_v<T,cfwdfunc_t>){
-			entireCode += fmt::format("{}float {}() {{\n{}}}\n", exportSpec, name, code);
-			auto fp = new cfwdfunc_t;
+			entireCode += fmt::format("{}calc {}() {{\n{}}}\n", exportSpec, name, code);
+			auto fp = new cfwdfunc_t(nullptr);
 			fwdfuncs[name] = fp;
 			return (T*)fp;
 		}
 		else if(std::is_same_v<T,cbwdfunc_t>){
-			entireCode += fmt::format("{}void {}(float gradient) {{\n{}}}\n", exportSpec, name, code);
-			auto fp = new cbwdfunc_t;
+			entireCode += fmt::format("{}void {}(accum gradient) {{\n{}}}\n", exportSpec, name, code);
+			auto fp = new cbwdfunc_t(nullptr);
 			bwdfuncs[name] = fp;
 			return (T*)fp;
 		}
+		else if(std::is_same_v<T,cseedfunc_t>){
+			entireCode += fmt::format("{}void {}(const accum* seeds) {{\n{}}}\n", exportSpec, name, code);
+			auto fp = new cseedfunc_t(nullptr);
+			seedfuncs[name] = fp;
+			return (T*)fp;
+		}
+	}
+	// Adds 'void name(void* const* p)' to one of the extra translation units. The units are compiled
+	// by separate compiler processes in parallel and linked into the same shared library.
+	void addChunk(std::string const& name, std::string const& code) {
+		if (nChunks < nUnits)
+			units.emplace_back();
+		units[nChunks++ % nUnits] += fmt::format("void {}(void* const* p) {{\n{}}}\n", name, code);
+		entireCode += fmt::format("void {}(void* const* p);\n", name);
+	}
+	// Replaces the addresses in generated code (pointer literals, not hex floats like 0x1.8p+0) by
+	// p[0], p[1], ... in the order they first appear and appends them to addresses
+	static std::string parameterize(std::string const& code, std::vector<void*>& addresses) {
+		std::string out;
+		out.reserve(code.size());
+		std::unordered_map<uintptr_t, int> index;
+		for (size_t i = 0; i < code.size();) {
+			if (code.compare(i, 2, "0x") == 0 && (i == 0 || !(std::isalnum((unsigned char)code[i-1]) || code[i-1] == '_' || code[i-1] == '.'))) {
+				size_t end = i + 2;
+				while (end < code.size() && std::isxdigit((unsigned char)code[end]))
+					++end;
+				if (end > i + 2 && (end == code.size() || (code[end] != '.' && code[end] != 'p'))) {
+					auto address = (uintptr_t)std::stoull(code.substr(i + 2, end - i - 2), nullptr, 16);
+					auto [it, inserted] = index.try_emplace(address, (int)addresses.size());
+					if (inserted)
+						addresses.push_back((void*)address);
+					out += fmt::format("p[{}]", it->second);
+					i = end;
+					continue;
+				}
+			}
+			out += code[i++];
+		}
+		return out;
+	}
+	// A chunk function for the statements in code, returns the C statement calling it. The function
+	// is identified by the code without its addresses, which it gets as an argument, so the chunks
+	// of a rebuilt graph with the same structure, or of the unchanged part of an edited one, are not
+	// compiled again: the function stays loaded and is called through its address.
+	// The fragment code itself is not kept, but every call keeps its address table, and every
+	// compileAndLoad its library (on Linux also an open file descriptor), until the loader is destroyed.
+	std::string addFragment(std::string const& code) {
+		auto& table = addressTables.emplace_back();
+		auto shape = parameterize(code, table);
+		uint64_t h = 14695981039346656037ull; // FNV-1a
+		for (char c : shape)
+			h = (h ^ (unsigned char)c) * 1099511628211ull;
+		fragmentKey key = {h, std::hash<std::string>{}(shape)};
+		auto args = fmt::format("(void* const*){}", (void*)table.data());
+		if (auto it = fragments.find(key); it != fragments.end()) {
+			++nReused;
+			return fmt::format("((void(*)(void* const*)){})({});\n", it->second, args);
+		}
+		auto [it, inserted] = pendingFragments.try_emplace(key);
+		if (inserted) {
+			it->second = uniqueName("fragment");
+			addChunk(it->second, shape);
+		}
+		else
+			++nReused;
+		return fmt::format("{}({});\n", it->second, args);
+	}
+	void setParallelUnits(int n) {
+		nUnits = std::max(1, n);
 	}
 
+	// Builds everything added since the last call into a new library, earlier kernels stay loaded
 	void compileAndLoad() {
 		AutoTimer at(g_timer, _FUNC_);
-		std::ofstream file(fileName+".c");
-		file << entireCode;
-		file.close();
+		if (pending.empty() && units.empty())
+			return;
+		auto header = prelude + opRegistry::code();
+		std::vector<std::string> sources = {header + entireCode};
+		for (auto& unit : units)
+			sources.push_back(header + unit);
+		entireCode.clear();
+		units.clear();
+		nChunks = 0;
+		auto names = std::move(pending);
+		pending.clear();
+		auto libName = libraries.empty() ? fileName : fmt::format("{}_l{}", fileName, libraries.size());
 
+		void* library;
 		{
 			std::string architectureFlag;
 			std::string compiler;
@@ -98,32 +314,39 @@ public:
 			compiler = "tcc\\tcc.exe";
 			std::cout << "Mode is x32\n";
 #endif
-			std::string args = "-O3 -ffast-math " + architectureFlag;
+			std::string args = flags + " " + architectureFlag;
 
 			AutoTimer at(g_timer, "compiler");
-			system(fmt::format("{2} {0} -c -o {1}{3} {1}.c", args, fileName, compiler, libExp).c_str());
-			std::cout << "Created .lib\n";
-
-			system(fmt::format("{2} {0} -shared -o {1}{4} {1}{3}", args, fileName, compiler, libExp, sharedLibExp).c_str());
-			std::cout << "Created .dll\n";
-
-			system(fmt::format("{2} {0} -S -o {1}.asm {1}.c", args, fileName, compiler, libExp).c_str());
-			std::cout << "Created assembly\n";
+#if defined(__linux__)
+			library = buildInMemory(sources, compiler, args);
+#else
+			library = buildOnDisk(libName, sources, compiler, args);
+#endif
+			if (dumpAssembly && runCompiler(fmt::format("{} {} -S -x c -o {}.asm -", compiler, args, libName), sources[0]))
+				std::cout << "Created assembly\n";
 		}
+		auto newFragments = std::move(pendingFragments);
+		pendingFragments.clear();
+		if (nReused || !newFragments.empty())
+			std::cout << fmt::format("Compiled {} fragments, reused {}\n", newFragments.size(), nReused);
+		nReused = 0;
+		if (!library)
+			return;
+		libraries.push_back(library);
+		for (auto& [key, name] : newFragments)
+			if (void* f = loadFunction(library, name.c_str()))
+				fragments.emplace(key, f);
 
-		std::string str = fmt::format("{}{}", fileName, sharedLibExp);
-		library = loadLibrary("./"+str);
-
-		for (auto& [name, fp] : fwdfuncs) {
-			*fp = (cfwdfunc_t)loadFunction(library, name.c_str());
-			if (!*fp) std::cout << "ERROR: loading func: "<<name<<"\n";
-		}
-		for (auto& [name, fp] : bwdfuncs) {
-			*fp = (cbwdfunc_t)loadFunction(library, name.c_str());
-			if (!*fp) std::cout << "ERROR: loading func: "<<name<<"\n";
-		}
+		auto resolve = [&](auto& funcs, std::string const& name) {
+			auto it = funcs.find(name);
+			if (it == funcs.end())
+				return false;
+			*it->second = (std::remove_pointer_t<decltype(it->second)>)loadFunction(library, name.c_str());
+			if (!*it->second) std::cout << "ERROR: loading func: "<<name<<"\n";
+			return true;
+		};
+		for (auto& name : names)
+			resolve(fwdfuncs, name) || resolve(bwdfuncs, name) || resolve(seedfuncs, name);
 		std::cout << "Loaded .dll\n";
 	}
 };
-
-
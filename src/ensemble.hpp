@@ -0,0 +1,96 @@
+﻿#pragma once
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+
+// Evaluates one graph structure for K independent parameter sets at once, e.g. different
+// initial values or step sizes. Every node stores K lanes of values and adjoints and the
+// forward and backward pass run the (vectorized) lane loops of the operations.
+// The leaves of the graph itself are only read: parameters are copied into all lanes on
+// construction, constants and placeholders on every update().
+class ensemble {
+	int K;
+	std::vector<expr*> plan;
+	std::unordered_map<expr const*, int> slots; // node -> position in plan
+	std::vector<std::vector<int>> parentSlots;
+	std::vector<value_t> values;  // [slot*K + lane]
+	std::vector<accum> adjoints;
+
+	template<class T> T* lanes(std::vector<T>& a, int slot) { return &a[slot*K]; }
+public:
+	ensemble(dual const& root, int K) : K{K} {
+		AutoTimer at(g_timer, _FUNC_);
+		plan = expr::buildPlan({root.getExpr()});
+		values.resize(plan.size()*K);
+		adjoints.resize(plan.size()*K);
+		parentSlots.resize(plan.size());
+		for (int i = 0; i < plan.size(); ++i) {
+			slots[plan[i]] = i;
+			std::fill_n(lanes(values, i), K, plan[i]->value);
+			if (plan[i]->op)
+				for (auto& p : plan[i]->op->parents)
+					parentSlots[i].push_back(slots.at(p.get()));
+		}
+	}
+	int size() const { return K; }
+	// The K lanes of a node, e.g. to set the initial values of a parameter per lane
+	value_t* value(dual const& d) { return lanes(values, slots.at(d.getExpr())); }
+	accum* grad(dual const& d) { return lanes(adjoints, slots.at(d.getExpr())); }
+	// Pointers to every lane of the parameters, to run any element-wise optimizer on all lanes
+	paramRefs lanesOf(std::vector<dual> const& params) {
+		std::vector<value_t*> v;
+		std::vector<accum*> g;
+		for (auto& p : params)
+			for (int k = 0; k < K; ++k) {
+				v.push_back(value(p) + k);
+				g.push_back(grad(p) + k);
+			}
+		return paramRefs(v, g);
+	}
+
+	void update() {
+		AutoTimer at(g_timer, _FUNC_);
+		std::vector<value_t const*> in;
+		for (int i = 0; i < plan.size(); ++i) {
+			expr* e = plan[i];
+			if (!e->op) {
+				if (!e->needsGrad())
+					std::fill_n(lanes(values, i), K, e->value);
+				continue;
+			}
+			in.clear();
+			for (int p : parentSlots[i])
+				in.push_back(lanes(values, p));
+			e->op->fwdLanes(lanes(values, i), in.data(), K);
+		}
+	}
+	// Gradient of the root in every lane, afterwards grad() holds the lanes of each node
+	void backward() {
+		AutoTimer at(g_timer, _FUNC_);
+		std::fill(adjoints.begin(), adjoints.end(), 0);
+		std::fill_n(lanes(adjoints, (int)plan.size()-1), K, 1);
+		std::vector<value_t const*> in;
+		std::vector<accum*> adj;
+		for (int i = (int)plan.size()-1; i >= 0; --i) {
+			expr* e = plan[i];
+			if (!e->op || !e->needsGrad())
+				continue;
+			in.clear();
+			adj.clear();
+			for (int j = 0; j < parentSlots[i].size(); ++j) {
+				in.push_back(lanes(values, parentSlots[i][j]));
+				adj.push_back(e->op->parents[j]->needsGrad() ? lanes(adjoints, parentSlots[i][j]) : nullptr);
+			}
+			e->op->bwdLanes(adj.data(), lanes(adjoints, i), in.data(), lanes(values, i), K);
+		}
+	}
+	// Gradient descent with its own step size in every lane, for step size sweeps
+	void sgdStep(std::vector<dual> const& params, std::vector<calc> const& lr) {
+		for (auto& p : params) {
+			value_t* v = value(p);
+			accum const* g = grad(p);
+			for (int k = 0; k < K; ++k)
+				v[k] -= lr[k]*g[k];
+		}
+	}
+};
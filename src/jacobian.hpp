@@ -0,0 +1,191 @@
+﻿#pragma once
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+
+// Sparse matrix in compressed sparse row form, the column indices of a row are sorted
+struct csrMatrix {
+	int rows = 0, cols = 0;
+	std::vector<int> rowPtr, colIdx;
+	std::vector<calc> values;
+	calc at(int r, int c) const {
+		auto begin = colIdx.begin() + rowPtr[r], end = colIdx.begin() + rowPtr[r+1];
+		auto it = std::lower_bound(begin, end, c);
+		return it != end && *it == c ? values[it - colIdx.begin()] : 0;
+	}
+};
+
+// Jacobian of several outputs with respect to several inputs, for sparse problems like
+// least-squares residual systems. The sparsity pattern is read off the graph once. Columns
+// that never meet in a row (or rows that never share a column) are merged by greedy coloring,
+// and the compressed Jacobian is computed with one forward (or reverse) sweep that carries one
+// lane per color, whichever mode needs fewer colors.
+// Inputs are treated as independent variables, even if they are not leaves.
+class jacobian {
+	std::vector<expr*> plan;
+	std::vector<int> outSlots, inSlots;
+	std::vector<int> inputIndex; // slot -> column, -1 for other nodes
+	std::vector<std::vector<int>> parentSlots;
+	std::vector<char> active; // depends on any input
+	std::vector<int> colors;  // per column (forward) or per row (reverse)
+	int nColors = 0;
+	bool reverse = false;
+	std::vector<accum> lanes;
+	std::vector<calc> partials;
+	std::vector<int> partialOffsets;
+	csrMatrix result;
+
+	accum* lanesOf(int slot) { return &lanes[slot*nColors]; }
+
+	// Greedy distance-2 coloring: items conflicting via a shared index get different colors
+	static int color(std::vector<std::vector<int>> const& itemsOf, std::vector<std::vector<int>> const& indicesOf, std::vector<int>& colors) {
+		int n = 0;
+		std::vector<int> usedBy; // color -> last item that saw it used by a neighbour
+		colors.assign(indicesOf.size(), -1);
+		for (int item = 0; item < indicesOf.size(); ++item) {
+			for (int idx : indicesOf[item])
+				for (int other : itemsOf[idx])
+					if (colors[other] >= 0)
+						usedBy[colors[other]] = item;
+			int c = 0;
+			while (c < n && usedBy[c] == item)
+				++c;
+			if (c == n) {
+				usedBy.push_back(-1);
+				++n;
+			}
+			colors[item] = c;
+		}
+		return n;
+	}
+	// Values and partial derivatives at the current leaf values
+	void linearize() {
+		for (int i = 0; i < plan.size(); ++i) {
+			expr* e = plan[i];
+			if (!e->op)
+				continue;
+			e->value = e->op->fwd();
+			if (active[i] && inputIndex[i] < 0)
+				for (int j = 0; j < parentSlots[i].size(); ++j)
+					partials[partialOffsets[i] + j] = e->op->bwd(j);
+		}
+	}
+public:
+	jacobian(std::vector<dual> const& outputs, std::vector<dual> const& inputs) {
+		AutoTimer at(g_timer, _FUNC_);
+		std::vector<expr*> roots;
+		for (auto& o : outputs)
+			roots.push_back(o.getExpr());
+		plan = expr::buildPlan(roots);
+		std::unordered_map<expr const*, int> slots;
+		for (int i = 0; i < plan.size(); ++i)
+			slots[plan[i]] = i;
+		for (auto& o : outputs)
+			outSlots.push_back(slots.at(o.getExpr()));
+		inputIndex.assign(plan.size(), -1);
+		for (int j = 0; auto& in : inputs) {
+			auto it = slots.find(in.getExpr());
+			inSlots.push_back(it == slots.end() ? -1 : it->second); // an input no output depends on
+			if (it != slots.end())
+				inputIndex[it->second] = j;
+			++j;
+		}
+
+		// Sparsity: the sorted set of inputs every node depends on
+		std::vector<std::vector<int>> deps(plan.size());
+		parentSlots.resize(plan.size());
+		partialOffsets.resize(plan.size());
+		active.resize(plan.size());
+		int nPartials = 0;
+		for (int i = 0; i < plan.size(); ++i) {
+			if (plan[i]->op)
+				for (auto& p : plan[i]->op->parents)
+					parentSlots[i].push_back(slots.at(p.get()));
+			if (inputIndex[i] >= 0)
+				deps[i] = {inputIndex[i]};
+			else
+				for (int p : parentSlots[i]) {
+					std::vector<int> merged;
+					std::ranges::set_union(deps[i], deps[p], std::back_inserter(merged));
+					deps[i] = std::move(merged);
+				}
+			active[i] = !deps[i].empty();
+			partialOffsets[i] = nPartials;
+			nPartials += parentSlots[i].size();
+		}
+		partials.resize(nPartials);
+
+		result.rows = outputs.size();
+		result.cols = inputs.size();
+		result.rowPtr = {0};
+		for (int s : outSlots) {
+			result.colIdx.insert(result.colIdx.end(), deps[s].begin(), deps[s].end());
+			result.rowPtr.push_back(result.colIdx.size());
+		}
+		result.values.resize(result.colIdx.size());
+
+		// Forward mode merges columns sharing no row, reverse mode rows sharing no column
+		std::vector<std::vector<int>> rowsOfCol(result.cols), colsOfRow(result.rows);
+		for (int r = 0; r < result.rows; ++r)
+			for (int k = result.rowPtr[r]; k < result.rowPtr[r+1]; ++k) {
+				colsOfRow[r].push_back(result.colIdx[k]);
+				rowsOfCol[result.colIdx[k]].push_back(r);
+			}
+		std::vector<int> colColors, rowColors;
+		int nColColors = color(colsOfRow, rowsOfCol, colColors);
+		int nRowColors = color(rowsOfCol, colsOfRow, rowColors);
+		reverse = nRowColors < nColColors;
+		colors = reverse ? rowColors : colColors;
+		nColors = std::max(1, reverse ? nRowColors : nColColors);
+		lanes.resize(plan.size()*nColors);
+	}
+	int numColors() const { return nColors; }
+	bool isReverse() const { return reverse; }
+	csrMatrix const& pattern() const { return result; }
+
+	// Recomputes the outputs and their Jacobian at the current input values
+	csrMatrix const& evaluate() {
+		AutoTimer at(g_timer, _FUNC_);
+		linearize();
+		std::fill(lanes.begin(), lanes.end(), 0);
+		const int K = nColors;
+		if (!reverse) {
+			for (int j = 0; j < inSlots.size(); ++j)
+				if (inSlots[j] >= 0)
+					lanesOf(inSlots[j])[colors[j]] = 1;
+			for (int i = 0; i < plan.size(); ++i) {
+				if (!active[i] || inputIndex[i] >= 0)
+					continue;
+				accum* t = lanesOf(i);
+				for (int j = 0; j < parentSlots[i].size(); ++j) {
+					calc d = partials[partialOffsets[i] + j];
+					accum const* tp = lanesOf(parentSlots[i][j]);
+					for (int c = 0; c < K; ++c)
+						t[c] += d*tp[c];
+				}
+			}
+			for (int r = 0; r < result.rows; ++r)
+				for (int k = result.rowPtr[r]; k < result.rowPtr[r+1]; ++k)
+					result.values[k] = lanesOf(outSlots[r])[colors[result.colIdx[k]]];
+		}
+		else {
+			for (int r = 0; r < outSlots.size(); ++r)
+				lanesOf(outSlots[r])[colors[r]] += 1;
+			for (int i = (int)plan.size()-1; i >= 0; --i) {
+				if (!active[i] || inputIndex[i] >= 0)
+					continue;
+				accum const* a = lanesOf(i);
+				for (int j = 0; j < parentSlots[i].size(); ++j) {
+					calc d = partials[partialOffsets[i] + j];
+					accum* ap = lanesOf(parentSlots[i][j]);
+					for (int c = 0; c < K; ++c)
+						ap[c] += d*a[c];
+				}
+			}
+			for (int r = 0; r < result.rows; ++r)
+				for (int k = result.rowPtr[r]; k < result.rowPtr[r+1]; ++k)
+					result.values[k] = lanesOf(inSlots[result.colIdx[k]])[colors[r]];
+		}
+		return result;
+	}
+};
@@ -4,8 +4,27 @@
 #include <memory>
 
 #include "timer.hpp"
+#include "scalar.hpp"
+#include "random.hpp"
+#include "opKernels.hpp"
 #include "dynamicLoader.hpp"
+#include "nativeEmitter.hpp"
 #include "dual.hpp"
+#include "staticDual.hpp"
+#include "optimizer.hpp"
+#include "ensemble.hpp"
+#include "outputGroup.hpp"
+#include "jacobian.hpp"
+#include "autotune.hpp"
+#include "dataset.hpp"
+#include "bytecode.hpp"
+
+
+// Ops can be added outside the library, the generated code takes their kernels from the registry
+REGISTER_OP(softsign, 1, false,
+static inline calc softsignF(const calc* x, int n) { return x[0]/(1+calcFabs(x[0])); }
+static inline calc softsignDf(int i, const calc* x, int n, calc y) { return (1-calcFabs(y))*(1-calcFabs(y)); }
+)
 
 
 #include <random>
@@ -60,20 +79,24 @@ __m128 FastExpSse(__m128 x)
 	return _mm_castsi128_ps(t);
 }
 
-template<bool COMPILED = false>
-void optimize(dual& loss, std::vector<dual>& vars, int niters, float step, std::function<void()> const& printVars = nullptr) {
+// FUSED: the compiled backward kernel applies the optimizer step itself, see optimizer::generateStep
+template<bool COMPILED = false, bool FUSED = false>
+void optimize(dual& loss, optimizer& opt, int niters, std::function<void()> const& printVars = nullptr,
+			  std::function<void()> const& feed = nullptr) {
 	for (int i = 0; i < niters; ++i) {
-		for (auto& v : vars)
-			v.grad() = 0;
+		if (!FUSED)
+			opt.zeroGrad();
 
 		if (COMPILED)
 			loss.backwardC();
 		else
 			loss.backward();
 
-		for(auto& v : vars)
-			v.value() -= v.grad()*step;
-		
+		if (!FUSED)
+			opt.step();
+
+		if (feed)
+			feed();
 		if (COMPILED)
 			loss.updateC();
 		else
@@ -162,34 +185,50 @@ void linearRegression() {
 			vars[2].setVarName("mmu");
 			vars[3].setVarName("msg");
 			reset();
-			sample();
 		}
+		randomStream rng{16}; // the noise is drawn inside the graph, resample() needs no rebuild
 		void sample() {
-			static std::normal_distribution<> dist(0, 1);
-			b = vars[0] + exp(vars[1]) * dist(gen);
-			m = vars[2] + exp(vars[3]) * dist(gen);
+			b = vars[0] + exp(vars[1]) * dual::randomNormal(rng);
+			m = vars[2] + exp(vars[3]) * dual::randomNormal(rng);
+		}
+		void resample() {
+			rng.advance();
 		}
-		dual operator()(float x)  {
+		dual operator()(dual const& x)  {
 			return b + m*x;
 		};
 		void reset() {
 			for (int i = 0; auto& v : vars) {
 				v.value() = initialValues[i++];
 			}
+			rng.step = 0; // every run sees the same noise
 		};
 	} model;
 	
 
+	// The data enters the graph through placeholders, new (mini-)batches need no new graph
+	std::vector<dual> xs, ys;
+	for (int i = 0; i < nPoints; ++i) {
+		xs.push_back(dual::placeholder(fmt::format("x{}", i)));
+		ys.push_back(dual::placeholder(fmt::format("y{}", i)));
+	}
 	dual mse;
 	for (int s = 0; s < nSamples; ++s){
 		model.sample();
-		for (int i = 0; i < nPoints; ++i) {
-			auto& [x, y] = points[i];
-			mse = mse + pow(model(x)-y, 2);
-		}
+		for (int i = 0; i < nPoints; ++i)
+			mse = mse + pow(model(xs[i])-ys[i], 2);
 	}
 	mse = mse / (nSamples * nPoints);
 
+	std::vector<calc> px, py;
+	for (auto& [x, y] : points) {
+		px.push_back(x);
+		py.push_back(y);
+	}
+	feed(xs, px);
+	feed(ys, py);
+	auto resample = [&]() { model.resample(); };
+
 	auto printVars = [&]() {
 		std::cout << fmt::format("loss = {:8.4f}", mse.value());
 		for (auto& v : model.vars)
@@ -199,48 +238,442 @@ void linearRegression() {
 
 	std::cout << mse.getExprString() << "\n";
 	auto counter = mse.getNumNodes();
-	fmt::print("Leaf count: {}, num constants: {}, num req. gradient: {}, num nograd: {}\n",
-			   counter.nNodes, counter.nConstants, counter.nReqGrad, counter.nNodes-counter.nConstants-counter.nReqGrad);
+	fmt::print("Leaf count: {}, num constants: {}, num req. gradient: {}, num placeholders: {}, num nograd: {}\n",
+			   counter.nNodes, counter.nConstants, counter.nReqGrad, counter.nPlaceholders,
+			   counter.nNodes-counter.nConstants-counter.nReqGrad-counter.nPlaceholders);
+	fmt::print("Operations: {} ({} transcendental), depth: {}, tree size: {}\n",
+			   counter.nOps, counter.nTranscendental, counter.depth, counter.nTreeNodes);
 
 	{
 		AutoTimer at(g_timer, "Normal");
 		for (int i = 0; i < nReps; ++i) {
 			model.reset();
 			mse.update();
-			optimize<false>(mse, model.vars, nIters, step, printVars);
+			sgd opt(model.vars, step);
+			optimize<false>(mse, opt, nIters, printVars, resample);
 		}
 	}
 	printVars();
 
 	std::cout << std::string(50, '-') << std::endl; // --------------------
 
-	/*DynamicLoader dl({"math"});
-	mse.compile(dl);
+	// The backend is picked per graph from a short trial run, cached in autotune.txt
+	DynamicLoader dl({"math"});
+	NativeEmitter em;
+	autotuner tuner("autotune.txt");
+	auto choice = tuner.tune(mse, nReps*nIters, dl, em);
+	std::cout << "Backend: " << choice.toString() << "\n";
 
 	{
-		AutoTimer at(g_timer, "Compiled");
+		AutoTimer at(g_timer, "Auto");
+		for (int i = 0; i < nReps; ++i) {
+			model.reset();
+			sgd opt(model.vars, step);
+			if (choice.usesKernels()) {
+				mse.updateC();
+				optimize<true>(mse, opt, nIters, nullptr, resample);
+			}
+			else {
+				mse.update();
+				optimize<false>(mse, opt, nIters, nullptr, resample);
+			}
+		}
+	}
+	printVars();
+
+	if (nativeKernels) { // float builds only
+		mse.compileNative(em);
+
+		AutoTimer at(g_timer, "Native");
 		for (int i = 0; i < nReps; ++i) {
 			model.reset();
 			mse.updateC();
-			optimize<true>(mse, model.vars, nIters, step);
+			sgd opt(model.vars, step);
+			optimize<true>(mse, opt, nIters, nullptr, resample);
+		}
+	}
+	printVars();
+
+	// No compile step, the graph runs as bytecode
+	{
+		bytecode program(mse);
+		AutoTimer at(g_timer, "Bytecode");
+		for (int i = 0; i < nReps; ++i) {
+			model.reset();
+			program.update();
+			sgd opt(model.vars, step);
+			for (int it = 0; it < nIters; ++it) {
+				opt.zeroGrad();
+				program.backward();
+				opt.step();
+				model.resample();
+				program.update();
+			}
+		}
+	}
+	printVars();
+
+	// Second order fit of the loss with the noise held fixed
+	{
+		AutoTimer at(g_timer, "L-BFGS");
+		model.reset();
+		bool kernels = nativeKernels || choice.usesKernels();
+		lbfgs opt(model.vars, [&]() {
+			if (kernels) {
+				mse.updateC();
+				mse.backwardC();
+			}
+			else {
+				mse.update();
+				mse.backward();
+			}
+			return mse.value();
+		});
+		for (int i = 0; i < 20; ++i)
+			opt.step();
+	}
+	printVars();
+
+	// Step size sweep, all runs train at once in the lanes of one ensemble
+	{
+		AutoTimer at(g_timer, "Ensemble");
+		const int nLanes = 8;
+		model.reset();
+		ensemble ens(mse, nLanes);
+		std::vector<calc> steps;
+		for (int k = 0; k < nLanes; ++k)
+			steps.push_back(0.01f*(k+1));
+		ens.update();
+		for (int i = 0; i < nIters; ++i) {
+			ens.backward();
+			ens.sgdStep(model.vars, steps);
+			model.resample();
+			ens.update();
+		}
+		for (int k = 0; k < nLanes; ++k) {
+			std::cout << fmt::format("step = {:5.2f}: loss = {:8.4f}", steps[k], ens.value(mse)[k]);
+			for (auto& v : model.vars)
+				std::cout << fmt::format(", {} = {:8.4f}", v.getVarName(), ens.value(v)[k]);
+			std::cout << "\n";
 		}
 	}
-	printVars();*/
 
 	// Save result parameters to file
 	std::ofstream paramFile("params.txt");
 	for (auto& v : model.vars)
 		paramFile << v.value() << "\n";
 	paramFile.close();
+
+	// The optimizer step fused into the compiled backward kernel, on the same trajectory as the separate step
+	{
+		std::vector<calc> losses[2];
+		for (bool fused : {false, true}) {
+			model.reset();
+			sgd opt(model.vars, step, 0.5f);
+			DynamicLoader fdl({"math"});
+			mse.compile(fdl, -1, fused ? opt.generateStep() : "");
+			mse.updateC();
+			auto record = [&]() { losses[fused].push_back(mse.value()); };
+			AutoTimer at(g_timer, fused ? "Fused" : "Unfused");
+			if (fused)
+				optimize<true, true>(mse, opt, nIters, record, resample);
+			else
+				optimize<true, false>(mse, opt, nIters, record, resample);
+		}
+		calc diff = 0;
+		for (int i = 0; i < nIters; ++i)
+			diff = std::max(diff, std::abs(losses[0][i] - losses[1][i]));
+		std::cout << fmt::format("fused step: loss = {:8.4f}, max difference to separate step {:.2g}\n", losses[1].back(), diff);
+	}
+}
+
+// Fits the point estimates of b and m, the loss structure is known at compile time
+void staticRegression() {
+	const int nPoints = 7;
+	int nIters = 1000;
+	float step = 0.05;
+
+	float points[nPoints][2];
+	std::normal_distribution<> dist(0, 1);
+	for (int i = 0; i < nPoints; ++i) {
+		float x = (float)i/nPoints;
+		points[i][0] = x;
+		points[i][1] = 1.2 - 2.3*x + 0.1*dist(gen);
+	}
+
+	sdual::var<0> b;
+	sdual::var<1> m;
+	auto pointLoss = [&](float x, float y) { return sdual::pow(b + m*x - y, 2); };
+	std::array<value_t, 2> vals = {1, 1};
+	std::array<accum, 2> grads;
+	calc loss = 0;
+	{
+		AutoTimer at(g_timer, "Static");
+		for (int it = 0; it < nIters; ++it) {
+			grads = {};
+			loss = 0;
+			for (auto& [x, y] : points) {
+				auto l = pointLoss(x, y);
+				loss += l.fwd(vals) / nPoints;
+				l.bwd(accum(1) / nPoints, grads);
+			}
+			for (int i = 0; i < vals.size(); ++i)
+				vals[i] -= grads[i]*step;
+		}
+	}
+	std::cout << fmt::format("static: loss = {:8.4f}, b = {:8.4f}, m = {:8.4f}\n", loss, vals[0], vals[1]);
+
+	// The same loss as runtime graph
+	std::vector<dual> vars = {dual(vals[0], true), dual(vals[1], true)};
+	dual mse;
+	for (auto& [x, y] : points)
+		mse = mse + pointLoss(x, y).toDual(vars);
+	mse = mse / nPoints;
+	std::cout << fmt::format("runtime graph: loss = {:8.4f}\n", mse.value());
+}
+
+// Loss and gradient of a line fit in the scalar types of this build (AUTOGRAD_PRECISION), by the static
+// and the compiled graph, against plain float arithmetic. bf16 rounds every node to 8 bits of mantissa,
+// differences are relative to the scale of the data.
+// Training with bf16 parameters is a different matter: steps below half a unit of the last place are lost.
+void precisionCheck() {
+	const int nPoints = 7;
+	std::vector<float> px, py;
+	for (int i = 0; i < nPoints; ++i) {
+		float x = (float)i/nPoints;
+		px.push_back(x);
+		py.push_back(1.2f - 2.3f*x + 0.05f*(i*3%5 - 2));
+	}
+	// The reference with the gradient written out
+	auto reference = [&](float b, float m) {
+		std::array<float, 3> r = {};
+		for (int i = 0; i < nPoints; ++i) {
+			float d = b + m*px[i] - py[i];
+			r[0] += d*d/nPoints;
+			r[1] += 2*d/nPoints;
+			r[2] += 2*d*px[i]/nPoints;
+		}
+		return r;
+	};
+
+	sdual::var<0> b;
+	sdual::var<1> m;
+	std::vector<dual> vars = {dual(1, true), dual(1, true)};
+	dual mse;
+	for (int i = 0; i < nPoints; ++i)
+		mse = mse + pow(vars[0] + vars[1]*px[i] - py[i], 2);
+	mse = mse / nPoints;
+	DynamicLoader dl({"math"});
+	mse.compile(dl);
+
+	float worst = 0;
+	auto compare = [&](std::array<float, 3> const& ref, calc loss, accum gb, accum gm) {
+		std::array<double, 3> x = {loss, gb, gm};
+		for (int j = 0; j < 3; ++j)
+			worst = std::max<float>(worst, std::abs(x[j] - ref[j]) / std::max(std::abs(ref[j]), 1.f));
+	};
+	for (auto [b0, m0] : {std::pair{1.f, 1.f}, {0.5f, -1.f}, {1.3f, -2.5f}}) {
+		auto ref = reference(b0, m0);
+
+		std::array<value_t, 2> vals = {b0, m0};
+		std::array<accum, 2> grads = {};
+		calc loss = 0;
+		for (int i = 0; i < nPoints; ++i) {
+			auto l = sdual::pow(b + m*px[i] - py[i], 2);
+			loss += l.fwd(vals) / nPoints;
+			l.bwd(accum(1) / nPoints, grads);
+		}
+		compare(ref, loss, grads[0], grads[1]);
+
+		vars[0].value() = b0;
+		vars[1].value() = m0;
+		for (auto& v : vars)
+			v.grad() = 0;
+		mse.updateC();
+		mse.backwardC();
+		compare(ref, mse.value(), vars[0].grad(), vars[1].grad());
+	}
+	bool bf16 = std::is_same_v<value_t, bfloat16>;
+	float tolerance = bf16 ? 2e-2f : 1e-4f;
+	std::cout << fmt::format("{}precision {}: loss and gradient within {:.2g} of float (tolerance {:.2g})\n",
+							 worst > tolerance ? "ERROR: " : "", bf16 ? "bf16" : std::is_same_v<value_t, double> ? "double" : "float",
+							 worst, tolerance);
+}
+
+// Jacobian of the residuals of a discretized boundary value problem, x'' + 0.1 x^3 = f: every residual
+// depends on three neighbouring unknowns. An added constraint on the sum of all unknowns makes one
+// row dense, then merging rows beats merging columns.
+void sparseJacobian() {
+	const int n = 200;
+	std::vector<dual> xs;
+	for (int i = 0; i < n; ++i)
+		xs.push_back(dual(std::sin(0.1f*i), true));
+	std::vector<dual> residuals;
+	for (int i = 0; i < n; ++i) {
+		dual r = 0.1f*pow(xs[i], 3) - 2*xs[i] - 0.01f*i;
+		if (i > 0)
+			r = r + xs[i-1];
+		if (i < n-1)
+			r = r + xs[i+1];
+		residuals.push_back(r);
+	}
+	dual sum = xs[0];
+	for (int i = 1; i < n; ++i)
+		sum = sum + xs[i];
+
+	auto check = [&](std::vector<dual> const& outputs, std::string const& name) {
+		jacobian jac(outputs, xs);
+		csrMatrix const& J = jac.evaluate();
+		// One backward pass per output gives the dense rows
+		accum diff = 0;
+		for (int r = 0; r < outputs.size(); ++r) {
+			for (auto& x : xs)
+				x.grad() = 0;
+			outputs[r].getExpr()->backward();
+			for (int c = 0; c < n; ++c)
+				diff = std::max<accum>(diff, std::abs(J.at(r, c) - xs[c].grad()));
+		}
+		std::cout << fmt::format("{}: {}x{} with {} nonzeros, {} colors in {} mode, max difference to backward() {:.2g}\n",
+								 name, J.rows, J.cols, J.values.size(), jac.numColors(), jac.isReverse() ? "reverse" : "forward", diff);
+	};
+	check(residuals, "banded");
+	residuals.push_back(sum - 1);
+	check(residuals, "banded + sum");
+}
+
+// Fits b and m to a dataset streamed from disk in chunks, only one chunk of rows is in the graph
+void streamingRegression() {
+	const int nRows = 100000, chunkRows = 256;
+	int nEpochs = 50;
+	float step = 0.5;
+
+	std::vector<std::vector<float>> columns(2);
+	std::normal_distribution<> dist(0, 1);
+	for (int i = 0; i < nRows; ++i) {
+		float x = (float)i/nRows;
+		columns[0].push_back(x);
+		columns[1].push_back(1.2 - 2.3*x + 0.1*dist(gen));
+	}
+	columnarFile::write("points.bin", columns);
+
+	std::vector<dual> vars = {dual(1, true), dual(1, true)};
+	vars[0].setVarName("b");
+	vars[1].setVarName("m");
+	streamingLoss pointLoss(2, chunkRows, [&](std::vector<dual> const& row) { return pow(vars[0] + vars[1]*row[0] - row[1], 2); });
+	DynamicLoader dl({"math"});
+	pointLoss.compile(dl);
+
+	columnarFile data("points.bin");
+	sgd opt(vars, step);
+	calc loss = 0;
+	{
+		AutoTimer at(g_timer, "Streaming");
+		for (int i = 0; i < nEpochs; ++i) {
+			opt.zeroGrad();
+			loss = pointLoss.evaluate(data);
+			opt.step();
+		}
+	}
+	std::cout << fmt::format("streaming: loss = {:8.4f}, b = {:8.4f}, m = {:8.4f}\n", loss, vars[0].value(), vars[1].value());
+
+	// Text files are parsed on the prefetch thread
+	textFile text("points.txt");
+	opt.zeroGrad();
+	std::cout << fmt::format("points.txt: loss = {:8.4f}\n", pointLoss.evaluate(text));
+}
+
+// Edits and rebuilds of a compiled loss: only chunks of new structure are compiled again
+void incrementalCompile() {
+	const int chunkSize = 64;
+	auto buildLoss = [](std::vector<dual> const& vars, int nPoints) {
+		dual mse;
+		for (int i = 0; i < nPoints; ++i) {
+			float x = i/400.f;
+			mse = mse + pow(vars[0] + vars[1]*x - (1.2f - 2.3f*x), 2);
+		}
+		return mse / nPoints;
+	};
+	std::vector<dual> vars = {dual(1, true), dual(1, true)};
+	dual mse = buildLoss(vars, 400);
+
+	DynamicLoader dl({"math"});
+	{
+		AutoTimer at(g_timer, "Compile");
+		mse.compile(dl, chunkSize);
+	}
+	dual regularized = mse + 0.1f*pow(vars[1], 2);
+	{
+		AutoTimer at(g_timer, "Recompile");
+		regularized.compile(dl, chunkSize);
+	}
+	regularized.updateC();
+	std::cout << fmt::format("regularized: loss = {:8.4f}\n", regularized.value());
+
+	// Define-by-run: the loss is built again from new nodes, the compiled chunks are found by structure
+	for (int nPoints : {400, 401}) {
+		std::vector<dual> fresh = {dual(1, true), dual(1, true)};
+		dual rebuilt = buildLoss(fresh, nPoints);
+		rebuilt.backward();
+		accum grad = fresh[1].grad();
+		fresh[1].grad() = 0;
+		{
+			AutoTimer at(g_timer, "Rebuild");
+			rebuilt.compile(dl, chunkSize);
+		}
+		rebuilt.updateC();
+		rebuilt.backwardC();
+		std::cout << fmt::format("rebuilt {} points: loss = {:8.4f}, dm = {:8.4f}, interpreter {:8.4f}\n",
+								 nPoints, rebuilt.value(), fresh[1].grad(), grad);
+	}
+}
+
+// A graph of the op registered above, compiled and interpreted
+void customOp() {
+	std::vector<dual> vars = {dual(0.5f, true), dual(-0.3f, true)};
+	dual loss;
+	for (int i = 0; i < 20; ++i) {
+		float x = (float)i/10 - 1;
+		loss = loss + dual::apply("softsign", {vars[0]*x + vars[1]});
+	}
+	loss.update();
+	loss.backward();
+	calc value = loss.value();
+	std::vector<accum> grads;
+	for (auto& v : vars) {
+		grads.push_back(v.grad());
+		v.grad() = 0;
+	}
+	DynamicLoader dl({"math"});
+	loss.compile(dl);
+	loss.updateC();
+	loss.backwardC();
+	accum diff = 0;
+	for (int i = 0; i < vars.size(); ++i)
+		diff = std::max<accum>(diff, std::abs(vars[i].grad() - grads[i]));
+	std::cout << fmt::format("softsign: loss = {:8.4f}, compiled {:8.4f}, max gradient difference {:.2g}\n",
+							 value, loss.value(), diff);
 }
 
 int main() {
 	linearRegression();
+	staticRegression();
+	precisionCheck();
+	sparseJacobian();
+	streamingRegression();
+	incrementalCompile();
+	customOp();
 
 	g_timer.print();
-	std::cout << fmt::format("Speed-up: x{:.2}\n",
+	std::cout << fmt::format("Speed-up auto: x{:.2}\n",
+							 g_timer.getTotalSeconds("Normal")
+							 /g_timer.getTotalSeconds("Auto"));
+	std::cout << fmt::format("Speed-up bytecode: x{:.2}\n",
 							 g_timer.getTotalSeconds("Normal")
-							 /g_timer.getTotalSeconds("Compiled"));
+							 /g_timer.getTotalSeconds("Bytecode"));
+	if (nativeKernels) // float builds only
+		std::cout << fmt::format("Speed-up native: x{:.2}\n",
+								 g_timer.getTotalSeconds("Normal")
+								 /g_timer.getTotalSeconds("Native"));
 	std::cin.get();
 	return 0;
 }
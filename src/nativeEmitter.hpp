@@ -0,0 +1,146 @@
+﻿#pragma once
+#include <vector>
+#include <deque>
+#include <memory>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+#include <type_traits>
+
+#if defined _WIN32
+	void* allocExecutable(size_t size){
+		return VirtualAlloc(nullptr, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	}
+	bool protectExecutable(void* p, size_t size){
+		DWORD old;
+		return VirtualProtect(p, size, PAGE_EXECUTE_READ, &old);
+	}
+	void freeExecutable(void* p, size_t){
+		VirtualFree(p, 0, MEM_RELEASE);
+	}
+	constexpr uint8_t nativeStackReserve = 40; // shadow space + alignment
+#else
+	void* allocExecutable(size_t size){
+		void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		return p == MAP_FAILED ? nullptr : p;
+	}
+	bool protectExecutable(void* p, size_t size){
+		return !mprotect(p, size, PROT_READ | PROT_EXEC);
+	}
+	void freeExecutable(void* p, size_t size){
+		munmap(p, size);
+	}
+	constexpr uint8_t nativeStackReserve = 8; // keeps rsp 16 byte aligned for calls
+#endif
+
+// Writes x86-64 machine code for graph kernels directly into executable memory,
+// no external compiler involved. All values live in memory, the kernels use
+// xmm0 as accumulator (A) and xmm1 as second operand (B) with scalar SSE instructions.
+// Values and gradients have to be float (see scalar.hpp).
+constexpr bool nativeKernels = std::is_same_v<value_t, float> && std::is_same_v<accum, float>;
+class NativeEmitter {
+	std::vector<uint8_t> code;
+	std::deque<float> constants; // literals referenced by the code, deque keeps their addresses stable
+	std::vector<std::pair<size_t, cfwdfunc_t*>> pendingFwd;
+	std::vector<std::pair<size_t, cbwdfunc_t*>> pendingBwd;
+	std::vector<std::unique_ptr<cfwdfunc_t>> fwdfuncs;
+	std::vector<std::unique_ptr<cbwdfunc_t>> bwdfuncs;
+	std::vector<std::pair<void*, size_t>> regions;
+
+	void bytes(std::initializer_list<uint8_t> b) {
+		code.insert(code.end(), b);
+	}
+	void movRax(const void* p) { // mov rax, imm64
+		size_t n = code.size();
+		code.resize(n + 10);
+		code[n] = 0x48;
+		code[n+1] = 0xB8;
+		std::memcpy(&code[n+2], &p, 8);
+	}
+	void prologue() { bytes({0x48, 0x83, 0xEC, nativeStackReserve}); } // sub rsp, imm8
+public:
+	~NativeEmitter() {
+		for (auto [p, size] : regions)
+			freeExecutable(p, size);
+	}
+	void loadA(void const* p)   { movRax(p); bytes({0xF3, 0x0F, 0x10, 0x00}); } // movss xmm0, [rax]
+	void loadB(void const* p)   { movRax(p); bytes({0xF3, 0x0F, 0x10, 0x08}); } // movss xmm1, [rax]
+	void storeA(void* p)        { movRax(p); bytes({0xF3, 0x0F, 0x11, 0x00}); } // movss [rax], xmm0
+	void moveAtoB()             { bytes({0x0F, 0x28, 0xC8}); }                   // movaps xmm1, xmm0
+	void add()                  { bytes({0xF3, 0x0F, 0x58, 0xC1}); }             // addss xmm0, xmm1
+	void sub()                  { bytes({0xF3, 0x0F, 0x5C, 0xC1}); }             // subss xmm0, xmm1
+	void mul()                  { bytes({0xF3, 0x0F, 0x59, 0xC1}); }             // mulss xmm0, xmm1
+	void div()                  { bytes({0xF3, 0x0F, 0x5E, 0xC1}); }             // divss xmm0, xmm1
+	void sqrt()                 { bytes({0xF3, 0x0F, 0x51, 0xC0}); }             // sqrtss xmm0, xmm0
+	void negate() {
+		loadB(constant(-0.f));
+		bytes({0x0F, 0x57, 0xC1}); // xorps xmm0, xmm1
+	}
+	// Calls a C function, A (and B) are the arguments, the result ends up in A
+	void call(float(*f)(float))        { movRax((void*)f); bytes({0xFF, 0xD0}); } // call rax
+	void call(float(*f)(float, float)) { movRax((void*)f); bytes({0xFF, 0xD0}); }
+	void call(float(*f)(void const*), void const* arg) {
+#if defined _WIN32
+		bytes({0x48, 0xB9}); // mov rcx, imm64
+#else
+		bytes({0x48, 0xBF}); // mov rdi, imm64
+#endif
+		size_t n = code.size();
+		code.resize(n + 8);
+		std::memcpy(&code[n], &arg, 8);
+		movRax((void*)f);
+		bytes({0xFF, 0xD0});
+	}
+	float const* constant(float c) {
+		constants.push_back(c);
+		return &constants.back();
+	}
+
+	// A forward kernel leaves its result in A before endFunction
+	cfwdfunc_t* beginForward() {
+		pendingFwd.emplace_back(code.size(), fwdfuncs.emplace_back(new cfwdfunc_t(nullptr)).get());
+		prologue();
+		return pendingFwd.back().second;
+	}
+	// The gradient argument of a backward kernel arrives in A
+	cbwdfunc_t* beginBackward() {
+		pendingBwd.emplace_back(code.size(), bwdfuncs.emplace_back(new cbwdfunc_t(nullptr)).get());
+		prologue();
+		return pendingBwd.back().second;
+	}
+	void endFunction() {
+		bytes({0x48, 0x83, 0xC4, nativeStackReserve}); // add rsp, imm8
+		bytes({0xC3});                                 // ret
+	}
+
+	// Copies all code emitted since the last call into executable memory and resolves the function pointers
+	void finalize() {
+		AutoTimer at(g_timer, _FUNC_);
+		if (code.empty())
+			return;
+		void* p = allocExecutable(code.size());
+		if (!p) {
+			std::cout << "ERROR: allocating executable memory\n";
+			return;
+		}
+		std::memcpy(p, code.data(), code.size());
+		if (!protectExecutable(p, code.size())) {
+			std::cout << "ERROR: protecting executable memory\n";
+			freeExecutable(p, code.size());
+			return;
+		}
+		regions.emplace_back(p, code.size());
+		for (auto [offset, fp] : pendingFwd)
+			*fp = (cfwdfunc_t)((uint8_t*)p + offset);
+		for (auto [offset, fp] : pendingBwd)
+			*fp = (cbwdfunc_t)((uint8_t*)p + offset);
+		pendingFwd.clear();
+		pendingBwd.clear();
+		code.clear();
+	}
+};
+
+// libm entry points the emitted code calls into
+inline float (*const nativeExp)(float) = [](float x) { return std::exp(x); };
+inline float (*const nativeLog)(float) = [](float x) { return std::log(x); };
+inline float (*const nativePow)(float, float) = [](float x, float y) { return std::pow(x, y); };
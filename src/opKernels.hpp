@@ -0,0 +1,126 @@
+﻿#pragma once
+#include <cmath>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <map>
+
+// An op declared once by its kernels, everything else is derived from them. The kernels are
+// valid C and C++ at once like the random number functions, their text goes into the generated
+// code, so forward and derivative are written exactly once, in the precision calc (scalar.hpp):
+//   <name>F(x, n):        the value for the n operands x
+//   <name>Df(i, x, n, y): the derivative wrt x[i], where y = <name>F(x, n)
+// The lane loops are the vectorization hook, the defaults inline the kernels.
+struct opInfo {
+	using kernel_t = calc(*)(const calc* x, int n);
+	using derivative_t = calc(*)(int i, const calc* x, int n, calc y);
+	using lanes_t = void(*)(value_t* out, value_t const* const* in, int n, int K);
+	using derivativeLanes_t = void(*)(accum* const* adj, accum const* g, value_t const* const* in, value_t const* out, int n, int K);
+	std::string_view name;
+	int arity; // -1: any number of operands
+	bool transcendental;
+	kernel_t f;
+	derivative_t df;
+	lanes_t fLanes;
+	derivativeLanes_t dfLanes;
+	std::string_view code; // C source of f and df
+	bool foldConstants = true; // ops with constant operands become constants
+};
+// The operands of one lane, on the stack unless there are very many
+struct laneOperands {
+	calc small[16];
+	std::vector<calc> large;
+	calc* x;
+	laneOperands(int n) : x{n <= 16 ? small : (large.resize(n), large.data())} {}
+	calc const* gather(value_t const* const* in, int n, int k) {
+		for (int j = 0; j < n; ++j)
+			x[j] = in[j][k];
+		return x;
+	}
+};
+template<opInfo::kernel_t F>
+void defaultLanes(value_t* out, value_t const* const* in, int n, int K) {
+	laneOperands ops(n);
+	for (int k = 0; k < K; ++k)
+		out[k] = F(ops.gather(in, n, k), n);
+}
+template<opInfo::derivative_t DF>
+void defaultDerivativeLanes(accum* const* adj, accum const* g, value_t const* const* in, value_t const* out, int n, int K) {
+	laneOperands ops(n);
+	for (int k = 0; k < K; ++k) {
+		calc const* x = ops.gather(in, n, k);
+		for (int i = 0; i < n; ++i)
+			if (adj[i])
+				adj[i][k] += g[k] * DF(i, x, n, out[k]);
+	}
+}
+class opRegistry {
+	static std::map<std::string, opInfo, std::less<>>& ops() {
+		static std::map<std::string, opInfo, std::less<>> m;
+		return m;
+	}
+	static std::vector<std::string>& order() {
+		static std::vector<std::string> names;
+		return names;
+	}
+public:
+	static opInfo const& add(opInfo const& info) {
+		auto [it, inserted] = ops().insert_or_assign(std::string(info.name), info);
+		if (inserted)
+			order().push_back(it->first);
+		return it->second;
+	}
+	static opInfo const* find(std::string_view name) {
+		auto it = ops().find(name);
+		return it == ops().end() ? nullptr : &it->second;
+	}
+	// The kernels of all ops for the generated code, in the order of registration
+	static std::string code() {
+		std::string s;
+		for (auto& name : order())
+			s += std::string(ops().at(name).code) + "\n";
+		return s;
+	}
+};
+// Defines the kernels <NAME>F and <NAME>Df given after the arguments and registers them as <NAME>Op.
+// Ops can be registered anywhere before the kernels using them are compiled, the kernels may call
+// those of ops registered earlier.
+#define REGISTER_OP(NAME, ARITY, TRANSCENDENTAL, ...) __VA_ARGS__ \
+	inline opInfo const& NAME##Op = opRegistry::add({#NAME, ARITY, TRANSCENDENTAL, NAME##F, NAME##Df, \
+		defaultLanes<NAME##F>, defaultDerivativeLanes<NAME##Df>, #__VA_ARGS__});
+
+// The composites are formulated to stay finite where the naive chains of nodes overflow.
+REGISTER_OP(log, 1, true,
+static inline calc logF(const calc* x, int n) { return calcLog(x[0]); }
+static inline calc logDf(int i, const calc* x, int n, calc y) { return 1/x[0]; }
+)
+REGISTER_OP(sigmoid, 1, true,
+static inline calc sigmoidF(const calc* x, int n) {
+	calc e = calcExp(-calcFabs(x[0]));
+	return x[0] >= 0 ? 1/(1+e) : e/(1+e);
+}
+static inline calc sigmoidDf(int i, const calc* x, int n, calc y) { return y*(1-y); }
+)
+REGISTER_OP(tanh, 1, true,
+static inline calc tanhF(const calc* x, int n) { return calcTanh(x[0]); }
+static inline calc tanhDf(int i, const calc* x, int n, calc y) { return 1-y*y; }
+)
+REGISTER_OP(softplus, 1, true,
+static inline calc softplusF(const calc* x, int n) { return calcFmax(x[0], 0) + calcLog1p(calcExp(-calcFabs(x[0]))); }
+static inline calc softplusDf(int i, const calc* x, int n, calc y) { return sigmoidF(x, n); }
+)
+REGISTER_OP(logSumExp, -1, true,
+static inline calc logSumExpF(const calc* x, int n) {
+	calc m = x[0], s = 0;
+	for (int j = 1; j < n; ++j)
+		m = calcFmax(m, x[j]);
+	for (int j = 0; j < n; ++j)
+		s += calcExp(x[j]-m);
+	return m + calcLog(s);
+}
+static inline calc logSumExpDf(int i, const calc* x, int n, calc y) { return calcExp(x[i]-y); }
+)
+REGISTER_OP(squaredError, 2, false,
+static inline calc squaredErrorF(const calc* x, int n) { return (x[0]-x[1])*(x[0]-x[1]); }
+static inline calc squaredErrorDf(int i, const calc* x, int n, calc y) { return (i ? -2 : 2)*(x[0]-x[1]); }
+)
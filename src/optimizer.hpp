@@ -0,0 +1,239 @@
+﻿#pragma once
+#include <vector>
+#include <deque>
+#include <string>
+#include <cmath>
+#include <numeric>
+#include <functional>
+
+// Where an optimizer finds the values and gradients it works on
+struct paramRefs {
+	std::vector<value_t*> values;
+	std::vector<accum*> grads;
+	paramRefs(std::vector<dual>& params) {
+		for (auto& p : params) {
+			values.push_back(&p.value());
+			grads.push_back(&p.grad());
+		}
+	}
+	paramRefs(std::vector<value_t*> values, std::vector<accum*> grads) : values{std::move(values)}, grads{std::move(grads)} {}
+	size_t size() const { return values.size(); }
+};
+
+// Parameters and optimizer state live in contiguous arrays. The graph leaves are only touched
+// twice per step: gather() copies values and gradients in, scatter() writes the values back.
+// The update rules are plain loops over these arrays, which the compiler vectorizes.
+class optimizer {
+protected:
+	std::vector<value_t*> values; // the leaves inside the graph
+	std::vector<accum*> grads;
+	std::vector<calc> x, g;
+
+	void gather() {
+		for (int i = 0; i < x.size(); ++i) {
+			x[i] = *values[i];
+			g[i] = *grads[i];
+		}
+	}
+	void scatter() {
+		for (int i = 0; i < x.size(); ++i)
+			*values[i] = x[i];
+	}
+	// Declares the arrays 'p' (values, accessed with v/sv) and 'g' (gradients) of pointers to the leaves in generated code
+	std::string generateLeafArrays() const {
+		return fmt::format("void* const* p = (void* const*){};\naccum* const* g = (accum* const*){};\nconst int n = {};\n",
+						   (void*)values.data(), (void*)grads.data(), values.size());
+	}
+public:
+	optimizer(paramRefs const& params) : values{params.values}, grads{params.grads}, x(params.size()), g(params.size()) {
+		zeroGrad();
+	}
+	virtual ~optimizer() = default;
+	// Generated steps hold the addresses of the arrays and hyperparameters, they must not move
+	optimizer(optimizer const&) = delete;
+	optimizer& operator=(optimizer const&) = delete;
+
+	void zeroGrad() {
+		for (auto* gr : grads)
+			*gr = 0;
+	}
+	// Applies one update from the gradients currently stored in the leaves
+	virtual void step() = 0;
+	// C code doing the same as zeroGrad() after step(), to be fused into a compiled backward kernel
+	// via dual::compile(dl, chunkSize, opt.generateStep()). Empty if the rule can't be fused.
+	virtual std::string generateStep() const { return ""; }
+};
+
+// Gradient descent with (heavy ball) momentum
+class sgd : public optimizer {
+	std::vector<calc> velocity;
+public:
+	float lr, momentum;
+	sgd(paramRefs const& params, float lr, float momentum = 0) : optimizer(params), velocity(params.size()), lr{lr}, momentum{momentum} {}
+	void step() override {
+		AutoTimer at(g_timer, _FUNC_);
+		gather();
+		for (int i = 0; i < x.size(); ++i) {
+			velocity[i] = momentum*velocity[i] + g[i];
+			x[i] -= lr*velocity[i];
+		}
+		scatter();
+	}
+	std::string generateStep() const override {
+		return "{\n" + generateLeafArrays() + fmt::format(
+			"calc* vel = (calc*){0};\n"
+			"for (int i = 0; i < n; ++i) {{\n"
+			"vel[i] = vf({2})*vel[i] + *g[i];\n"
+			"sv(p[i], v(p[i]) - vf({1})*vel[i]);\n"
+			"*g[i] = 0;\n"
+			"}}\n}}\n", (void*)velocity.data(), (void*)&lr, (void*)&momentum);
+	}
+};
+
+class adam : public optimizer {
+	std::vector<calc> m, s;
+	float t = 0;
+public:
+	float lr, beta1, beta2, eps;
+	adam(paramRefs const& params, float lr = 1e-3f, float beta1 = 0.9f, float beta2 = 0.999f, float eps = 1e-8f)
+		: optimizer(params), m(params.size()), s(params.size()), lr{lr}, beta1{beta1}, beta2{beta2}, eps{eps} {}
+	void step() override {
+		AutoTimer at(g_timer, _FUNC_);
+		gather();
+		t += 1;
+		calc c1 = lr / (1 - std::pow(beta1, t)), c2 = 1 / (1 - std::pow(beta2, t));
+		for (int i = 0; i < x.size(); ++i) {
+			m[i] = beta1*m[i] + (1-beta1)*g[i];
+			s[i] = beta2*s[i] + (1-beta2)*g[i]*g[i];
+			x[i] -= c1*m[i] / (std::sqrt(s[i]*c2) + eps);
+		}
+		scatter();
+	}
+	std::string generateStep() const override {
+		return "{\n" + generateLeafArrays() + fmt::format(
+			"calc* m = (calc*){0};\n"
+			"calc* s = (calc*){1};\n"
+			"calc b1 = vf({4}), b2 = vf({5});\n"
+			"calc t = vf({2}) += 1;\n"
+			"calc c1 = vf({3}) / (1 - calcPow(b1, t)), c2 = 1 / (1 - calcPow(b2, t));\n"
+			"for (int i = 0; i < n; ++i) {{\n"
+			"calc gi = *g[i];\n"
+			"m[i] = b1*m[i] + (1-b1)*gi;\n"
+			"s[i] = b2*s[i] + (1-b2)*gi*gi;\n"
+			"sv(p[i], v(p[i]) - c1*m[i] / (calcSqrt(s[i]*c2) + vf({6})));\n"
+			"*g[i] = 0;\n"
+			"}}\n}}\n", (void*)m.data(), (void*)s.data(), (void*)&t, (void*)&lr,
+			(void*)&beta1, (void*)&beta2, (void*)&eps);
+	}
+};
+
+// Limited memory BFGS with backtracking (Armijo) line search, for small smooth problems.
+// The objective recomputes loss and gradients at the current leaf values, e.g.
+//   [&]() { loss.update(); loss.backward(); return loss.value(); }
+// The gradients are cleared before every evaluation.
+class lbfgs : public optimizer {
+	std::function<calc()> objective;
+	int history;
+	std::deque<std::vector<calc>> ss, ys;
+	std::deque<calc> rhos;
+	calc f = 0;
+	bool started = false;
+
+	calc evaluate() {
+		zeroGrad();
+		calc val = objective();
+		gather();
+		return val;
+	}
+	static calc dot(std::vector<calc> const& a, std::vector<calc> const& b) {
+		return std::inner_product(a.begin(), a.end(), b.begin(), calc(0));
+	}
+public:
+	int maxLineSearch = 20;
+	float c1 = 1e-4f;
+	lbfgs(paramRefs const& params, std::function<calc()> objective, int history = 8)
+		: optimizer(params), objective{std::move(objective)}, history{history} {}
+	// Forgets the curvature history, needed when the values were changed from outside
+	void restart() {
+		ss.clear();
+		ys.clear();
+		rhos.clear();
+		started = false;
+	}
+	calc loss() const { return f; }
+	void step() override {
+		AutoTimer at(g_timer, _FUNC_);
+		if (!started) {
+			f = evaluate();
+			started = true;
+		}
+		// Two-loop recursion: d = -H*g
+		std::vector<calc> d(g.size());
+		for (int i = 0; i < d.size(); ++i)
+			d[i] = -g[i];
+		std::vector<calc> alphas(ss.size());
+		for (int k = (int)ss.size()-1; k >= 0; --k) {
+			alphas[k] = rhos[k] * dot(ss[k], d);
+			for (int i = 0; i < d.size(); ++i)
+				d[i] -= alphas[k]*ys[k][i];
+		}
+		if (!ss.empty()) {
+			calc gamma = dot(ss.back(), ys.back()) / dot(ys.back(), ys.back());
+			for (auto& di : d)
+				di *= gamma;
+		}
+		for (int k = 0; k < ss.size(); ++k) {
+			calc beta = rhos[k] * dot(ys[k], d);
+			for (int i = 0; i < d.size(); ++i)
+				d[i] += (alphas[k]-beta)*ss[k][i];
+		}
+		calc gtd = dot(g, d);
+		if (gtd >= 0) { // not a descent direction, fall back to steepest descent
+			restart();
+			started = true;
+			for (int i = 0; i < d.size(); ++i)
+				d[i] = -g[i];
+			gtd = -dot(g, g);
+		}
+		if (gtd == 0)
+			return; // converged
+
+		auto x0 = x, g0 = g;
+		calc f0 = f;
+		calc t = ss.empty() ? std::min<calc>(1, 1/std::sqrt(-gtd)) : 1;
+		bool accepted = false;
+		for (int ls = 0; ls < maxLineSearch && !accepted; ++ls, t *= 0.5f) {
+			for (int i = 0; i < x.size(); ++i)
+				x[i] = x0[i] + t*d[i];
+			scatter();
+			f = evaluate();
+			accepted = f <= f0 + c1*t*gtd; // false for NaN
+		}
+		if (!accepted) { // back to the last good point, the history led nowhere
+			x = std::move(x0);
+			g = std::move(g0);
+			f = f0;
+			scatter();
+			restart();
+			started = true; // f and g still hold the values at x
+			return;
+		}
+
+		std::vector<calc> s(x.size()), y(x.size());
+		for (int i = 0; i < x.size(); ++i) {
+			s[i] = x[i] - x0[i];
+			y[i] = g[i] - g0[i];
+		}
+		calc sy = dot(s, y);
+		if (sy > 1e-10f) {
+			ss.push_back(std::move(s));
+			ys.push_back(std::move(y));
+			rhos.push_back(1 / sy);
+			if (ss.size() > history) {
+				ss.pop_front();
+				ys.pop_front();
+				rhos.pop_front();
+			}
+		}
+	}
+};
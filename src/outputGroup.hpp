@@ -0,0 +1,75 @@
+﻿#pragma once
+#include <vector>
+#include <set>
+#include <string>
+
+// Several outputs of one graph, e.g. a loss together with metrics or constraint residuals.
+// They are evaluated together, so subgraphs shared between the outputs are computed once per
+// update, and the backward pass takes one seed per output: the gradient of sum(seeds[i]*outputs[i])
+// in a single reverse sweep.
+class outputGroup {
+	std::vector<dual> outputs;
+	std::vector<expr*> roots, plan;
+	cfwdfunc_t* fwdFunc = nullptr;
+	cseedfunc_t* bwdFunc = nullptr;
+public:
+	outputGroup(std::vector<dual> const& outputs) : outputs{outputs} {
+		for (auto& o : outputs)
+			roots.push_back(o.getExpr());
+		plan = expr::buildPlan(roots);
+	}
+	size_t size() const { return outputs.size(); }
+	dual& operator[](int i) { return outputs[i]; }
+	calc value(int i) const { return outputs[i].value(); }
+
+	void update() {
+		AutoTimer at(g_timer, _FUNC_);
+		for (auto* e : plan)
+			if (e->op)
+				e->value = e->op->fwd();
+	}
+	void backward(std::vector<accum> const& seeds) {
+		AutoTimer at(g_timer, _FUNC_);
+		for (auto* e : plan)
+			e->adjoint = 0;
+		for (int i = 0; i < roots.size(); ++i)
+			roots[i]->adjoint += seeds[i];
+		for (auto it = plan.rbegin(); it != plan.rend(); ++it) {
+			expr* e = *it;
+			if (!e->needsGrad())
+				continue;
+			e->grad += e->adjoint;
+			if (!e->op)
+				continue;
+			for (int i = 0; const auto& p : e->op->parents) {
+				if (p->needsGrad())
+					p->adjoint += e->op->bwd(i) * e->adjoint;
+				++i;
+			}
+		}
+	}
+
+	// chunkSize and bwdEpilogue as in dual::compile
+	void compile(DynamicLoader& dl, int chunkSize = -1, std::string const& bwdEpilogue = "") {
+		AutoTimer at(g_timer, _FUNC_);
+		if (chunkSize < 0)
+			chunkSize = plan.size() > dual::autoChunkThreshold ? dual::defaultChunkSize : 0;
+		auto [fwdBody, bwdBody] = expr::generateKernelBodies(dl, roots, plan, chunkSize);
+		fwdFunc = dl.addFunction<cfwdfunc_t>(dl.uniqueName("forward"), fmt::format("{}return v({});\n", fwdBody, (void*)&roots[0]->value));
+
+		std::string seedCode;
+		std::set<expr const*> seeded;
+		for (int i = 0; auto* r : roots) // the same node may be given twice
+			seedCode += fmt::format("va({}) {}= seeds[{}];\n", (void*)&r->adjoint, seeded.insert(r).second ? "" : "+", i++);
+		bwdFunc = dl.addFunction<cseedfunc_t>(dl.uniqueName("backward"), seedCode + bwdBody + bwdEpilogue);
+		dl.compileAndLoad();
+	}
+	void updateC() {
+		AutoTimer at(g_timer, _FUNC_);
+		(*fwdFunc)();
+	}
+	void backwardC(std::vector<accum> const& seeds) {
+		AutoTimer at(g_timer, _FUNC_);
+		(*bwdFunc)(seeds.data());
+	}
+};
@@ -0,0 +1,49 @@
+﻿#pragma once
+#include <cstdint>
+#include <cmath>
+#include <string>
+
+// Counter-based random numbers (Philox4x32-10). A number only depends on (seed, step, stream, lane),
+// so the interpreter, the generated kernels and any number of threads agree without sharing
+// generator state, and there are no data dependencies between draws.
+// The functions are valid C and C++ at once, the same text is put into the generated code.
+#define RNG_FUNCTIONS(...) __VA_ARGS__ \
+	inline const std::string rngCode = #__VA_ARGS__;
+
+RNG_FUNCTIONS(
+static inline void philox4x32(unsigned int c[4], unsigned int k0, unsigned int k1) {
+	for (int r = 0; r < 10; ++r) {
+		unsigned long long p0 = (unsigned long long)0xD2511F53u * c[0];
+		unsigned long long p1 = (unsigned long long)0xCD9E8D57u * c[2];
+		unsigned int n0 = (unsigned int)(p1 >> 32) ^ c[1] ^ k0;
+		unsigned int n2 = (unsigned int)(p0 >> 32) ^ c[3] ^ k1;
+		c[0] = n0;
+		c[1] = (unsigned int)p1;
+		c[2] = n2;
+		c[3] = (unsigned int)p0;
+		k0 += 0x9E3779B9u;
+		k1 += 0xBB67AE85u;
+	}
+}
+static inline float rngUniform(unsigned long long seed, unsigned long long step, unsigned int stream, unsigned int lane) {
+	unsigned int c[4] = {stream, lane, (unsigned int)step, (unsigned int)(step >> 32)};
+	philox4x32(c, (unsigned int)seed, (unsigned int)(seed >> 32));
+	return (c[0] >> 8) * (1.0f/16777216.0f);
+}
+static inline float rngNormal(unsigned long long seed, unsigned long long step, unsigned int stream, unsigned int lane) {
+	unsigned int c[4] = {stream, lane, (unsigned int)step, (unsigned int)(step >> 32)};
+	philox4x32(c, (unsigned int)seed, (unsigned int)(seed >> 32));
+	float u1 = ((c[0] >> 8) + 1) * (1.0f/16777216.0f);
+	float u2 = (c[1] >> 8) * (1.0f/16777216.0f);
+	return sqrtf(-2.0f*logf(u1)) * cosf(6.28318531f*u2);
+}
+)
+
+// Shared by all random nodes of a graph: every node owns a stream, advance() gives all of them a new draw
+struct randomStream {
+	uint64_t seed = 0;
+	uint64_t step = 0;
+	uint32_t nextStream = 0;
+	randomStream(uint64_t seed = 0) : seed{seed} {}
+	void advance() { ++step; }
+};
@@ -0,0 +1,97 @@
+﻿#pragma once
+#include <cstdint>
+#include <cmath>
+#include <string>
+
+// Scalar types of graphs and generated kernels, chosen at build time (AUTOGRAD_PRECISION in CMake):
+//   value_t  storage of node values: float, double (AUTOGRAD_DOUBLE) or bfloat16 (AUTOGRAD_BF16)
+//   calc     arithmetic of the kernels, float for 16 and 32 bit storage
+//   accum    gradients and adjoints, double with AUTOGRAD_WIDE_ACCUM
+// Compact storage halves the memory traffic of huge graphs, wide accumulation keeps the sums of
+// many small contributions exact. The same definitions are put into the generated code.
+// The types are global, all graphs of a process (runtime, static and generated) share one precision.
+#define SCALAR_FUNCTIONS(...) __VA_ARGS__ \
+	inline const std::string scalarFunctionCode = #__VA_ARGS__;
+
+SCALAR_FUNCTIONS(
+static inline unsigned short floatToBf16(float f) {
+	union { float f; unsigned int u; } c;
+	c.f = f;
+	if ((c.u & 0x7fffffffu) > 0x7f800000u)
+		return (unsigned short)((c.u >> 16) | 0x40u);
+	c.u += 0x7fffu + ((c.u >> 16) & 1u);
+	return (unsigned short)(c.u >> 16);
+}
+static inline float bf16ToFloat(unsigned short b) {
+	union { float f; unsigned int u; } c;
+	c.u = (unsigned int)b << 16;
+	return c.f;
+}
+)
+
+#define CALC_FUNCTIONS(...) __VA_ARGS__ \
+	inline const std::string calcFunctionCode = #__VA_ARGS__;
+
+#if defined AUTOGRAD_DOUBLE
+CALC_FUNCTIONS(
+typedef double calc;
+static inline calc calcExp(calc x) { return exp(x); }
+static inline calc calcLog(calc x) { return log(x); }
+static inline calc calcLog1p(calc x) { return log1p(x); }
+static inline calc calcTanh(calc x) { return tanh(x); }
+static inline calc calcFabs(calc x) { return fabs(x); }
+static inline calc calcFmax(calc x, calc y) { return fmax(x, y); }
+static inline calc calcSqrt(calc x) { return sqrt(x); }
+static inline calc calcPow(calc x, calc y) { return pow(x, y); }
+)
+#else
+CALC_FUNCTIONS(
+typedef float calc;
+static inline calc calcExp(calc x) { return expf(x); }
+static inline calc calcLog(calc x) { return logf(x); }
+static inline calc calcLog1p(calc x) { return log1pf(x); }
+static inline calc calcTanh(calc x) { return tanhf(x); }
+static inline calc calcFabs(calc x) { return fabsf(x); }
+static inline calc calcFmax(calc x, calc y) { return fmaxf(x, y); }
+static inline calc calcSqrt(calc x) { return sqrtf(x); }
+static inline calc calcPow(calc x, calc y) { return powf(x, y); }
+)
+#endif
+
+#if defined AUTOGRAD_DOUBLE || defined AUTOGRAD_WIDE_ACCUM
+typedef double accum;
+inline const std::string accumTypeCode = "typedef double accum;\n";
+#else
+typedef float accum;
+inline const std::string accumTypeCode = "typedef float accum;\n";
+#endif
+
+// 16 bit float with the exponent range of float, converts implicitly from and to float
+struct bfloat16 {
+	uint16_t bits = 0;
+	bfloat16() = default;
+	bfloat16(float f) : bits{floatToBf16(f)} {}
+	operator float() const { return bf16ToFloat(bits); }
+	bfloat16& operator+=(float f) { return *this = *this + f; }
+	bfloat16& operator-=(float f) { return *this = *this - f; }
+	bfloat16& operator*=(float f) { return *this = *this * f; }
+};
+template<> struct fmt::formatter<bfloat16> : fmt::formatter<float> {
+	auto format(bfloat16 b, format_context& ctx) const { return fmt::formatter<float>::format(b, ctx); }
+};
+
+// v(x) reads a value as calc, sv(x, e) stores one, va(x) is an accumulator and vf(x) a float of the host
+#if defined AUTOGRAD_DOUBLE
+using value_t = double;
+inline const std::string valueAccessCode = "#define v(x) (*((double*)(x)))\n#define sv(x, e) (v(x) = (e))\n";
+#elif defined AUTOGRAD_BF16
+using value_t = bfloat16;
+inline const std::string valueAccessCode = "#define v(x) bf16ToFloat(*((unsigned short*)(x)))\n"
+										   "#define sv(x, e) (*((unsigned short*)(x)) = floatToBf16(e), v(x))\n";
+#else
+using value_t = float;
+inline const std::string valueAccessCode = "#define v(x) (*((float*)(x)))\n#define sv(x, e) (v(x) = (e))\n";
+#endif
+
+inline const std::string scalarCode = scalarFunctionCode + "\n" + calcFunctionCode + "\n" + accumTypeCode + valueAccessCode
+	+ "#define va(x) (*((accum*)(x)))\n#define vf(x) (*((float*)(x)))\n";
@@ -0,0 +1,184 @@
+﻿#pragma once
+#include <array>
+#include <vector>
+#include <cmath>
+#include <concepts>
+
+// Compile-time graphs for losses whose structure is fixed: the graph is encoded in the type
+// of the expression, so forward and reverse pass are inlined into straight-line code by the
+// host compiler. Variables are indices into a std::array of values (and gradients), in the
+// scalar types of the runtime graphs (scalar.hpp).
+//
+//   sdual::var<0> b; sdual::var<1> m;
+//   auto loss = sdual::pow(b + m*x - y, 2);
+//   calc l = loss.fwd(values);   // caches the intermediate values in the expression
+//   loss.bwd(1, grads);          // accumulates dloss/dvalues into grads
+namespace sdual {
+
+struct nodeBase {};
+template<class T> concept node = std::derived_from<T, nodeBase>;
+
+template<int I>
+struct var : nodeBase {
+	template<size_t N> constexpr calc fwd(std::array<value_t, N> const& x) const { return x[I]; }
+	template<size_t N> constexpr void bwd(accum g, std::array<accum, N>& grads) const { grads[I] += g; }
+	template<class V> dual toDual(V const& vars) const { return vars[I]; }
+};
+struct constant : nodeBase {
+	calc c;
+	constexpr constant(calc c) : c{c} {}
+	template<size_t N> constexpr calc fwd(std::array<value_t, N> const&) const { return c; }
+	template<size_t N> constexpr void bwd(accum, std::array<accum, N>&) const {}
+	template<class V> dual toDual(V const&) const { return dual(c); }
+};
+
+template<class T> constexpr auto lift(T const& t) {
+	if constexpr (node<T>)
+		return t;
+	else
+		return constant(t);
+}
+
+// Every node caches its value during fwd, bwd relies on it
+template<node L, node R>
+struct binary : nodeBase {
+	L l;
+	R r;
+	mutable calc value = 0;
+	constexpr binary(L l, R r) : l{l}, r{r} {}
+};
+template<node A>
+struct unary : nodeBase {
+	A a;
+	mutable calc value = 0;
+	constexpr unary(A a) : a{a} {}
+};
+
+template<node L, node R>
+struct addNode : binary<L, R> {
+	using binary<L, R>::binary;
+	template<size_t N> constexpr calc fwd(std::array<value_t, N> const& x) const {
+		return this->value = this->l.fwd(x) + this->r.fwd(x);
+	}
+	template<size_t N> constexpr void bwd(accum g, std::array<accum, N>& grads) const {
+		this->l.bwd(g, grads);
+		this->r.bwd(g, grads);
+	}
+	template<class V> dual toDual(V const& vars) const { return this->l.toDual(vars) + this->r.toDual(vars); }
+};
+template<node L, node R>
+struct subNode : binary<L, R> {
+	using binary<L, R>::binary;
+	template<size_t N> constexpr calc fwd(std::array<value_t, N> const& x) const {
+		return this->value = this->l.fwd(x) - this->r.fwd(x);
+	}
+	template<size_t N> constexpr void bwd(accum g, std::array<accum, N>& grads) const {
+		this->l.bwd(g, grads);
+		this->r.bwd(-g, grads);
+	}
+	template<class V> dual toDual(V const& vars) const { return this->l.toDual(vars) - this->r.toDual(vars); }
+};
+template<node L, node R>
+struct mulNode : binary<L, R> {
+	using binary<L, R>::binary;
+	mutable calc lv = 0, rv = 0;
+	template<size_t N> constexpr calc fwd(std::array<value_t, N> const& x) const {
+		lv = this->l.fwd(x);
+		rv = this->r.fwd(x);
+		return this->value = lv * rv;
+	}
+	template<size_t N> constexpr void bwd(accum g, std::array<accum, N>& grads) const {
+		this->l.bwd(g*rv, grads);
+		this->r.bwd(g*lv, grads);
+	}
+	template<class V> dual toDual(V const& vars) const { return this->l.toDual(vars) * this->r.toDual(vars); }
+};
+template<node L, node R>
+struct divNode : binary<L, R> {
+	using binary<L, R>::binary;
+	mutable calc rv = 0;
+	template<size_t N> constexpr calc fwd(std::array<value_t, N> const& x) const {
+		calc lv = this->l.fwd(x);
+		rv = this->r.fwd(x);
+		return this->value = lv / rv;
+	}
+	template<size_t N> constexpr void bwd(accum g, std::array<accum, N>& grads) const {
+		this->l.bwd(g/rv, grads);
+		this->r.bwd(-g*this->value/rv, grads);
+	}
+	template<class V> dual toDual(V const& vars) const { return this->l.toDual(vars) / this->r.toDual(vars); }
+};
+template<node A>
+struct sqrtNode : unary<A> {
+	using unary<A>::unary;
+	template<size_t N> calc fwd(std::array<value_t, N> const& x) const {
+		return this->value = calcSqrt(this->a.fwd(x));
+	}
+	template<size_t N> void bwd(accum g, std::array<accum, N>& grads) const {
+		this->a.bwd(g/(2*this->value), grads);
+	}
+	template<class V> dual toDual(V const& vars) const { return sqrt(this->a.toDual(vars)); }
+};
+template<node A>
+struct expNode : unary<A> {
+	using unary<A>::unary;
+	template<size_t N> calc fwd(std::array<value_t, N> const& x) const {
+		return this->value = calcExp(this->a.fwd(x));
+	}
+	template<size_t N> void bwd(accum g, std::array<accum, N>& grads) const {
+		this->a.bwd(g*this->value, grads);
+	}
+	template<class V> dual toDual(V const& vars) const { return exp(this->a.toDual(vars)); }
+};
+template<node A>
+struct powcNode : unary<A> {
+	calc exponent;
+	mutable calc av = 0;
+	constexpr powcNode(A a, calc e) : unary<A>(a), exponent{e} {}
+	template<size_t N> calc fwd(std::array<value_t, N> const& x) const {
+		av = this->a.fwd(x);
+		return this->value = exponent == 2 ? av*av : calcPow(av, exponent);
+	}
+	template<size_t N> void bwd(accum g, std::array<accum, N>& grads) const {
+		this->a.bwd(exponent == 2 ? 2*g*av : g*exponent*calcPow(av, exponent-1), grads);
+	}
+	template<class V> dual toDual(V const& vars) const { return pow(this->a.toDual(vars), exponent); }
+};
+template<node L, node R>
+struct powNode : binary<L, R> {
+	using binary<L, R>::binary;
+	mutable calc lv = 0, rv = 0;
+	template<size_t N> calc fwd(std::array<value_t, N> const& x) const {
+		lv = this->l.fwd(x);
+		rv = this->r.fwd(x);
+		return this->value = calcPow(lv, rv);
+	}
+	template<size_t N> void bwd(accum g, std::array<accum, N>& grads) const {
+		this->l.bwd(g*rv*calcPow(lv, rv-1), grads);
+		this->r.bwd(g*this->value*calcLog(lv), grads);
+	}
+	template<class V> dual toDual(V const& vars) const { return pow(this->l.toDual(vars), this->r.toDual(vars)); }
+};
+
+// At least one operand has to be a node, the other one may be a plain number
+template<class L, class R> concept operands = node<L> || node<R>;
+template<template<class, class> class Op, class L, class R>
+constexpr auto makeBinary(L const& l, R const& r) {
+	return Op<decltype(lift(l)), decltype(lift(r))>(lift(l), lift(r));
+}
+
+template<class L, class R> requires operands<L, R>
+constexpr auto operator+(L const& l, R const& r) { return makeBinary<addNode>(l, r); }
+template<class L, class R> requires operands<L, R>
+constexpr auto operator-(L const& l, R const& r) { return makeBinary<subNode>(l, r); }
+template<class L, class R> requires operands<L, R>
+constexpr auto operator*(L const& l, R const& r) { return makeBinary<mulNode>(l, r); }
+template<class L, class R> requires operands<L, R>
+constexpr auto operator/(L const& l, R const& r) { return makeBinary<divNode>(l, r); }
+
+template<node A> constexpr auto sqrt(A const& a) { return sqrtNode<A>(a); }
+template<node A> constexpr auto exp(A const& a) { return expNode<A>(a); }
+template<node A> constexpr auto pow(A const& a, calc e) { return powcNode<A>(a, e); }
+template<node L, node R> constexpr auto pow(L const& l, R const& r) { return powNode<L, R>(l, r); }
+
+}
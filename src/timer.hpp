@@ -134,7 +134,7 @@ public:
 		return now() - current->startTime;
 	}
 	float getTotalSeconds(std::string const& name) const {
-		if (!entries.contains(name))
+		if (!entries.contains("/"+name))
 			return 0;
 		return entries.at("/"+name)->time;
 	}